@@ -0,0 +1,27 @@
+# Shared by the benchmarks - sourced, not run. Builds the shell like the default build task (.vscode/tasks.json),
+# into $BENCH_DIR (a temporary directory unless set), and times runs of it.
+
+set -e
+cd "$(dirname "$0")/.."
+
+if [ -z "$BENCH_DIR" ]; then
+	BENCH_DIR=$(mktemp -d "${TMPDIR:-/tmp}/myshell-bench.XXXXXX")
+	trap 'rm -rf "$BENCH_DIR"' EXIT
+fi
+SHELL_BIN="$BENCH_DIR/shell"
+gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 shell.c myshell.c -o "$SHELL_BIN"
+
+# now - seconds since the epoch, to the nanosecond (/proc/uptime only has 10ms ticks).
+now() {
+	date +%s.%N
+}
+
+# elapsed START - seconds since START (from now).
+elapsed() {
+	awk -v start="$1" -v end="$(now)" 'BEGIN { printf "%.3f", end - start }'
+}
+
+# rate COUNT SECONDS - COUNT per second.
+rate() {
+	awk -v count="$1" -v seconds="$2" 'BEGIN { printf "%.0f", (seconds > 0) ? count / seconds : 0 }'
+}
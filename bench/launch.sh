@@ -0,0 +1,31 @@
+#!/bin/sh
+# Launch throughput - runs N (default 5000) lines of /bin/true, an external command that does nothing, and reports
+# commands per second: with the fork based shell this tree started from (BASELINE_REV, default acc74c0), with the
+# default launch path, and with the zygote (MYSHELL_ZYGOTE=1).
+# usage: bench/launch.sh [N]
+
+. "$(dirname "$0")/common.sh"
+
+count=${1:-5000}
+script="$BENCH_DIR/launch.txt"
+yes /bin/true | head -n "$count" > "$script"
+
+# the baseline only reads its standard input, so every shell gets the script there.
+baseline_rev=${BASELINE_REV:-acc74c0}
+BASELINE_BIN="$BENCH_DIR/shell-baseline"
+mkdir -p "$BENCH_DIR/baseline"
+git show "$baseline_rev:shell.c" > "$BENCH_DIR/baseline/shell.c"
+git show "$baseline_rev:myshell.c" > "$BENCH_DIR/baseline/myshell.c"
+gcc -O3 -D_POSIX_C_SOURCE=200809 -w -std=c11 "$BENCH_DIR/baseline/shell.c" "$BENCH_DIR/baseline/myshell.c" -o "$BASELINE_BIN"
+
+start=$(now)
+"$BASELINE_BIN" < "$script"
+seconds=$(elapsed "$start")
+echo "fork ($baseline_rev): $count commands in ${seconds}s, $(rate "$count" "$seconds") cmd/s"
+
+for zygote in 0 1; do
+	start=$(now)
+	MYSHELL_ZYGOTE=$zygote "$SHELL_BIN" < "$script"
+	seconds=$(elapsed "$start")
+	echo "zygote=$zygote: $count commands in ${seconds}s, $(rate "$count" "$seconds") cmd/s"
+done
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Input loop throughput over a recorded corpus (bench/corpus.txt - builtin command lines and and-or lists, so no child
+# is launched): the corpus is repeated N times (default 4000, about 1M lines), read from a pipe (getline into the line
+# arena) and from a mapped script (-f). Reports lines/s, and the heap allocations per line in steady state - the
+# allocations of a run over the corpus once are taken out, so startup does not count.
+# usage: bench/parse.sh [N]
+
+. "$(dirname "$0")/common.sh"
+
+repeat=${1:-4000}
+corpus=bench/corpus.txt
+input="$BENCH_DIR/parse.txt"
+gcc -O2 -shared -fPIC bench/alloc_count.c -o "$BENCH_DIR/alloc_count.so"
+
+awk -v repeat="$repeat" '{ line[NR] = $0 } END { for (i = 0; i < repeat; i++) for (j = 1; j <= NR; j++) print line[j] }' \
+	"$corpus" > "$input"
+lines=$(wc -l < "$input")
+corpus_lines=$(wc -l < "$corpus")
+
+# allocations COMMAND... - heap allocations of the shell over the run.
+allocations() {
+	"$@" 2>&1 >/dev/null | awk '/^allocations:/ { count = $2 } END { print count }'
+}
+
+for mode in stdin mapped; do
+	if [ "$mode" = stdin ]; then
+		start=$(now)
+		cat "$input" | "$SHELL_BIN" > /dev/null
+		seconds=$(elapsed "$start")
+		once=$(cat "$corpus" | allocations env LD_PRELOAD="$BENCH_DIR/alloc_count.so" "$SHELL_BIN")
+		all=$(cat "$input" | allocations env LD_PRELOAD="$BENCH_DIR/alloc_count.so" "$SHELL_BIN")
+	else
+		start=$(now)
+		"$SHELL_BIN" -f "$input" > /dev/null
+		seconds=$(elapsed "$start")
+		once=$(allocations env LD_PRELOAD="$BENCH_DIR/alloc_count.so" "$SHELL_BIN" -f "$corpus")
+		all=$(allocations env LD_PRELOAD="$BENCH_DIR/alloc_count.so" "$SHELL_BIN" -f "$input")
+	fi
+	per_line=$(awk -v all="$all" -v once="$once" -v lines="$((lines - corpus_lines))" \
+		'BEGIN { printf "%.3f", (lines > 0) ? (all - once) / lines : 0 }')
+	echo "$mode: $lines lines in ${seconds}s, $(rate "$lines" "$seconds") lines/s, $per_line allocations/line"
+done
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Pipe throughput by pipe capacity - for each size (MYSHELL_PIPE_SIZE, "0" is the kernel default), pushes MIB MiB
+# (default 2048) through "dd | cat | cat" and reports MiB/s, best of 3 runs.
+# usage: bench/pipesize.sh [MIB] [SIZE...]
+
+. "$(dirname "$0")/common.sh"
+
+mib=${1:-2048}
+[ $# -gt 0 ] && shift
+sizes=${*:-0 64k 256k 1m}
+script="$BENCH_DIR/pipesize.txt"
+echo "dd if=/dev/zero bs=64k count=$((mib * 16)) status=none | cat | cat > /dev/null" > "$script"
+
+for size in $sizes; do
+	best=
+	for run in 1 2 3; do
+		start=$(now)
+		MYSHELL_PIPE_SIZE=$size "$SHELL_BIN" -f "$script"
+		seconds=$(elapsed "$start")
+		best=$(awk -v best="$best" -v seconds="$seconds" 'BEGIN { print (best == "" || seconds < best) ? seconds : best }')
+	done
+	echo "pipesize $size: ${mib} MiB in ${best}s, $(rate "$mib" "$best") MiB/s"
+done
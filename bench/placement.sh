@@ -0,0 +1,57 @@
+#!/bin/sh
+# Pipe throughput with and without co-location - pushes MIB MiB (default 4096) through "dd | cat | cat" and reports
+# MiB/s, best of 3 runs, for:
+#   none       - no policy, the scheduler places the stages.
+#   colocated  - MYSHELL_CPU_POLICY=node:0, every stage on the CPUs of node 0.
+#   split      - the stages pinned (taskset) alternately to the first CPU of node 0 and of node 1 - or, on a single node
+#                machine, to two different CPUs of it.
+# usage: bench/placement.sh [MIB]
+
+. "$(dirname "$0")/common.sh"
+
+mib=${1:-4096}
+count=$((mib * 16))
+
+# first_cpu NODE - the first CPU of the NUMA node, empty if there is no such node.
+first_cpu() {
+	if [ -r "/sys/devices/system/node/node$1/cpulist" ]; then
+		cut -d, -f1 "/sys/devices/system/node/node$1/cpulist" | cut -d- -f1
+	fi
+}
+
+near=$(first_cpu 0)
+far=$(first_cpu 1)
+modes="none colocated split"
+if [ -z "$far" ] && [ "$(nproc)" -gt 1 ]; then
+	far=$(($(nproc) - 1))
+	echo "single NUMA node - split runs on CPUs $near and $far of node 0."
+fi
+if [ -z "$near" ] || [ -z "$far" ] || [ "$near" = "$far" ]; then
+	echo "split skipped - needs two CPUs."
+	modes="none colocated"
+fi
+
+for mode in $modes; do
+	script="$BENCH_DIR/placement-$mode.txt"
+	policy=none
+	case $mode in
+	colocated)
+		policy=node:0
+		echo "dd if=/dev/zero bs=64k count=$count status=none | cat | cat > /dev/null" > "$script"
+		;;
+	split)
+		echo "taskset -c $near dd if=/dev/zero bs=64k count=$count status=none | taskset -c $far cat | taskset -c $near cat > /dev/null" > "$script"
+		;;
+	*)
+		echo "dd if=/dev/zero bs=64k count=$count status=none | cat | cat > /dev/null" > "$script"
+		;;
+	esac
+	best=
+	for run in 1 2 3; do
+		start=$(now)
+		MYSHELL_CPU_POLICY=$policy "$SHELL_BIN" -f "$script"
+		seconds=$(elapsed "$start")
+		best=$(awk -v best="$best" -v seconds="$seconds" 'BEGIN { print (best == "" || seconds < best) ? seconds : best }')
+	done
+	echo "$mode: ${mib} MiB in ${best}s, $(rate "$mib" "$best") MiB/s"
+done
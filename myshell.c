@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <string.h>
 #include <sys/types.h>
@@ -9,391 +10,4097 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/prctl.h>
+#include <linux/sched.h>
 
 #define GENERAL_SUCCESS (0)
 #define GENERAL_FAILURE (-1)
 #define PROC_ARGLIST_CONTINUE (1)
 #define PROC_ARGLIST_STOP (0)
+#define COMMAND_SYNTAX_ERROR (1)
+#define LAUNCH_STACK_SIZE (64 * 1024)
+#define PATH_CACHE_BUCKETS (256)
+#define INITIAL_PIPELINE_CAPACITY (8)
+#define REAPER_MAX_EVENTS (64)
+#define TRACE_FD_ENV "MYSHELL_TRACE_FD"
+#define TRACE_COMMAND_SIZE (64)
+#define CAPTURE_COPY_SIZE (64 * 1024)
+#define DEFAULT_PATH "/bin:/usr/bin"
+#define PIPE_SIZE_ENV "MYSHELL_PIPE_SIZE"
+#define PIPE_MAX_SIZE_FILE "/proc/sys/fs/pipe-max-size"
+#define ZYGOTE_ENV "MYSHELL_ZYGOTE"
+#define ZYGOTE_REQUEST_SIZE (64 * 1024)
+#define ZYGOTE_MAX_FDS (4)
+#define FAILED_CALL_SIZE (32)
+#define SERVER_LINE_SIZE (64 * 1024)
+#define SERVER_MAX_EVENTS (64)
+#define SYNTAX_ERROR_STATUS (2)
+#define STATUS_WORD "$?"
+#define MEMO_DIR_ENV "MYSHELL_MEMO_DIR"
+#define MEMO_COMMANDS_ENV "MYSHELL_MEMO_COMMANDS"
+#define FNV_OFFSET_BASIS (14695981039346656037ULL)
+#define FNV_PRIME (1099511628211ULL)
+#define CGROUP_PARENT_ENV "MYSHELL_CGROUP_PARENT"
+#define CGROUP_CPU_MAX_ENV "MYSHELL_CGROUP_CPU_MAX"
+#define CGROUP_MEMORY_MAX_ENV "MYSHELL_CGROUP_MEMORY_MAX"
+#define CGROUP_IO_MAX_ENV "MYSHELL_CGROUP_IO_MAX"
+#define CGROUP_NAME_SIZE (48)
+#define CGROUP_STAT_SIZE (4096)
+#define CPU_POLICY_ENV "MYSHELL_CPU_POLICY"
+#define NODE_CPULIST_FORMAT "/sys/devices/system/node/node%d/cpulist"
+#define CPU_POLICY_MAX_NODES (64)
 
-typedef int (*cmd_preparation_handler_t)(int, char**);
+extern char** environ;
 
-void sigchld_handler(int signum)
+/*
+ * Everything a child needs in order to exec a single command.
+ * Filled by the parent and read by the child, which shares the parent's memory until it calls execve (CLONE_VM | CLONE_VFORK).
+*/
+typedef struct {
+    const char* path;   // absolute (or user given) path of the executable, resolved by the parent.
+    char** argv;
+    int stdin_fd;   // dup2'd onto STDIN in the child, -1 to inherit the shell's STDIN.
+    int stdout_fd;  // dup2'd onto STDOUT in the child, -1 to inherit the shell's STDOUT.
+    int stderr_fd;  // dup2'd onto STDERR in the child, -1 to inherit the shell's STDERR, STDOUT_FILENO for the child's STDOUT.
+    bool is_foreground;
+    pid_t pgid;     // process group the child joins, 0 to lead a new one (the first stage of a pipeline).
+    bool is_terminal_owner;     // the child's process group becomes the foreground process group of the terminal.
+    int cgroup_fd;  // cgroup leaf the child moves itself to before execve, -1 to stay in the shell's (or placed by clone3).
+    const cpu_set_t* affinity;  // CPUs the child is pinned to before execve, NULL to inherit the shell's.
+    sigset_t child_sigmask;     // signal mask restored in the child right before execve.
+    char** script_argv;         // room for "/bin/sh", path and argv[1..] - the ENOEXEC fallback, NULL to skip it.
+    const char* failed_call;    // set by the child if it fails before execve, reported by the parent.
+    int child_errno;
+} launch_spec_t;
+
+typedef struct command command_t;
+
+// runs a builtin inside the shell process. returns the exit status of the builtin (0 on success).
+typedef int (*builtin_handler_t)(int, char**);
+
+typedef struct {
+    const char* name;
+    builtin_handler_t handler;
+    bool is_pure;   // reads and changes nothing of the shell's state - in parallel mode it runs as an external command.
+} builtin_t;
+
+// a launched child, from launch until it is reaped.
+typedef struct child_record {
+    pid_t pid;
+    int pidfd;          // readable once the child exits. -1 when reaping through the SIGCHLD signalfd.
+    bool is_reaped;
+    int status;         // as returned by wait4, valid once reaped.
+    struct rusage usage;        // as returned by wait4, valid once reaped.
+    struct timespec start_time; // CLOCK_MONOTONIC, right before launch.
+    struct timespec end_time;   // CLOCK_MONOTONIC, when reaped.
+    char command[TRACE_COMMAND_SIZE];   // argv[0] (truncated), for instrumentation.
+    int stage;          // index in its pipeline, 0 for a single command.
+    pid_t pgid;         // process group of its pipeline.
+    bool is_foreground;
+    int cgroup_fd;      // cgroup leaf of its pipeline, owned by the record of the last stage. -1 if none.
+    unsigned long cgroup_serial;    // names the leaf, see cgroup_name.
+    struct child_record* next;  // in the registry of live children.
+} child_record_t;
+
+// a command line that is not waited for when launched - in the background, or in parallel mode (-j).
+// lives from launch until its completion is reported (jobs, or its output is emitted) or it is waited for in the foreground (fg).
+typedef struct job {
+    int id;
+    char* command_line;
+    child_record_t* children;   // one per pipeline stage, pid -1 for a stage that was not launched.
+    size_t child_count;
+    int capture_fd;     // parallel mode - STDOUT of the command line, emitted in submission order once done. -1 otherwise.
+    struct job* next;
+} job_t;
+
+typedef struct {
+    char** argv;    // points into arglist, NULL terminated where the "|" was.
+    int argc;
+    bool is_error_to_output;    // "2>&1" (or "&>") - STDERR of the stage is its STDOUT: the pipe to the next stage, or
+                                // for the last one whatever its STDOUT ends up being.
+} pipeline_stage_t;
+
+// a classified command line - everything the run_* functions need, found in a single pass over the words.
+struct command {
+    pipeline_stage_t* stages;   // one for a simple command. grows geometrically, reused from line to line.
+    child_record_t* children;   // record of each stage when run in the foreground. same capacity as stages.
+    size_t stage_count;
+    size_t stage_capacity;
+    const char* input_path;     // "<" target, NULL if none.
+    const char* output_path;    // ">", ">>" or "&>" target, NULL if none.
+    bool is_append;             // ">>" - written with O_APPEND instead of truncated.
+    const char* error_path;     // "2>" target, NULL if none.
+    bool is_error_to_original_output;   // "2>&1" before ">" or ">>" - STDERR of the last stage is the STDOUT it would
+                                        // have without the output redirection, as redirections apply left to right.
+    bool is_background;         // ended with "&".
+};
+
+typedef struct path_cache_entry {
+    char* name;
+    char* path;
+    size_t dir_index;   // index (in path_cache.dirs) of the PATH directory the command was found in.
+    unsigned int hits;
+    struct path_cache_entry* next;
+} path_cache_entry_t;
+
+typedef struct {
+    char* dir;
+    struct timespec mtime;  // a command added to or removed from the directory changes its mtime.
+} path_dir_t;
+
+// stack for the launched child. the parent is suspended until the child execs or exits, so one stack is enough.
+static _Alignas(16) char launch_stack[LAUNCH_STACK_SIZE];
+
+/*
+ * Every child is reaped by a single loop waiting on an epoll set - one pidfd per child, or (on kernels without pidfd_open)
+ * a signalfd for SIGCHLD. No signal handler runs asynchronously, so foreground waits are never interrupted or raced.
+*/
+static struct {
+    int epoll_fd;
+    int signal_fd;  // -1 when pidfds are used.
+    child_record_t* children;   // registered and not yet reaped.
+    int input_fd;   // the shell's input, armed (EPOLLONESHOT) while waiting for it (see wait_for_input). -1 if none.
+    bool is_input_ready;
+} reaper = { .epoll_fd = -1, .signal_fd = -1, .children = NULL, .input_fd = -1 };
+
+// instrumentation - a JSON line per reaped child is written to this fd (MYSHELL_TRACE_FD), -1 when disabled.
+static int trace_fd = -1;
+
+// background jobs, ordered by id.
+static struct {
+    job_t* head;
+    job_t* tail;
+    int next_id;
+} jobs = { .head = NULL, .tail = NULL, .next_id = 1 };
+
+// descriptor of the current command line.
+static command_t current_command = {0};
+
+// parallel mode (-j N) - up to max_jobs command lines run at once, their outputs are emitted in submission order.
+static struct {
+    int max_jobs;   // 0 when off.
+    size_t launched;
+    struct timespec start_time;
+} parallel = {0};
+
+typedef enum {
+    STEP_PENDING,   // waiting for its dependencies, or for a free worker.
+    STEP_RUNNING,
+    STEP_SUCCEEDED,
+    STEP_FAILED,    // also when skipped because a dependency failed.
+} step_state_t;
+
+// a named command line of the dependency graph (see run_step_declaration).
+typedef struct {
+    char* name;
+    char** argv;    // private copy of the command words, NULL terminated. freed once launched.
+    char* kinds;
+    int argc;
+    size_t* dependencies;   // indices of earlier steps.
+    size_t dependency_count;
+    step_state_t state;
+    job_t* job;     // while running.
+} step_t;
+
+// the steps declared so far - launched as soon as their dependencies succeed, up to max_running at once.
+static struct {
+    step_t* steps;
+    size_t count;
+    size_t capacity;
+    size_t first_unfinished;    // every step before it has succeeded or failed.
+    int running;
+    int max_running;
+    command_t command;          // the command line of the step being launched.
+} dag = {0};
+
+// a launch request to the zygote - followed by the path and then the argc words of argv, each NUL terminated.
+// the passed fds come in this order: cwd (if has_cwd), stdin (if has_stdin), stdout (if has_stdout), stderr (if has_stderr).
+typedef struct {
+    bool is_foreground;
+    pid_t pgid;
+    bool is_terminal_owner;
+    bool has_cwd;
+    bool has_stdin;
+    bool has_stdout;
+    bool has_stderr;
+    bool is_error_to_output;    // "2>&1" - STDERR of the child is its STDOUT, nothing passed for it.
+    bool has_affinity;
+    cpu_set_t affinity;
+    int argc;
+} zygote_request_t;
+
+typedef struct {
+    pid_t pid;      // -1 if clone failed.
+    int clone_errno;
+    int child_errno;
+    char failed_call[FAILED_CALL_SIZE];    // empty unless the child failed before execve.
+} zygote_reply_t;
+
+// the optional launch helper (MYSHELL_ZYGOTE), see zygote_start.
+static struct {
+    pid_t pid;
+    int socket_fd;          // -1 when not running.
+    bool is_cwd_stale;      // the shell changed directory since the last request.
+    char failed_call[FAILED_CALL_SIZE];
+} zygote = { .pid = -1, .socket_fd = -1 };
+
+// a connection in server mode (-s) - runs one command line at a time, and sends back its exit status.
+typedef struct client {
+    int socket_fd;
+    int stdio_fds[3];   // as last passed by the client, -1 for the server's own.
+    job_t* job;         // the command line in flight, NULL if none. the socket is not polled meanwhile.
+    struct client* next;
+} client_t;
+
+// output memoization (MYSHELL_MEMO_DIR) - see run_memoized_command.
+static struct {
+    char* dir;          // where the outputs are kept, NULL when off.
+    char* commands;     // the allow-list (MYSHELL_MEMO_COMMANDS, comma separated), as NUL terminated names ended by "".
+} memo = {0};
+
+// a cgroup v2 leaf per pipeline (MYSHELL_CGROUP_PARENT), with the same limits for all - see init_cgroups.
+static struct {
+    int parent_fd;      // -1 when off.
+    const char* cpu_max;    // written to cpu.max of every leaf, NULL for no limit.
+    const char* memory_max; // written to memory.max of every leaf, NULL for no limit.
+    const char* io_max;     // written to io.max of every leaf, NULL for no limit.
+    unsigned long next_serial;
+    bool has_clone_into_cgroup;     // until clone3 turns out not to support CLONE_INTO_CGROUP (before linux 5.7).
+    launch_spec_t* shared_spec;     // MAP_SHARED - the child of clone3 reports a failure through it, see clone_into_cgroup.
+} cgroups = { .parent_fd = -1 };
+
+// where the children run (MYSHELL_CPU_POLICY, the cpupolicy builtin) - every stage of a pipeline gets the same CPUs.
+static struct {
+    char kind;          // '\0' none, 'f' a fixed mask (mask:LIST, node:N), 'n' round-robin over the NUMA nodes (node),
+                        // 's' round-robin over the CPUs of the shell (spread).
+    char* text;         // the policy as set, NULL for none.
+    cpu_set_t mask;     // 'f' - the mask. 's' - the CPUs of the shell.
+    cpu_set_t nodes[CPU_POLICY_MAX_NODES];  // 'n' - the CPUs of each node.
+    int node_count;
+    int next;           // 'n' - the node of the next pipeline. 's' - the CPU to start looking from for the next pipeline.
+} cpu_policy = {0};
+
+// set by the exit builtin, process_arglist then tells the shell to stop.
+static bool is_exit_requested = false;
+
+// $? - the exit status of the last command line (of the last pipeline stage, unless pipefail).
+static int last_status = 0;
+// set -o pipefail - a pipeline fails if any stage fails, with the status of the last stage that did.
+static bool is_pipefail = false;
+
+// the controlling terminal - set when the shell runs interactively (in the foreground process group of its STDIN).
+static struct {
+    bool is_interactive;
+    pid_t shell_pgid;
+} terminal = {0};
+
+// set by SIGINT - the shell forwards it to the process groups of its foreground pipelines (see reaper_interrupt).
+// SIGINT is blocked in the shell, except while it waits (see reaper_poll), so it is never caught right before a wait.
+static volatile sig_atomic_t is_interrupt_pending = 0;
+// counts the SIGINTs handled so far, so that a builtin waiting for jobs that ignore SIGINT can stop waiting.
+static unsigned long interrupt_count = 0;
+// the signal mask of the shell while it waits - SIGINT unblocked.
+static sigset_t wait_sigmask;
+
+// capacity of pipes between pipeline stages (F_SETPIPE_SZ), 0 for the kernel default.
+static size_t pipe_buffer_size = 0;
+// largest capacity an unprivileged process may set, 0 if unknown.
+static size_t pipe_max_size = 0;
+
+// command name -> absolute path, so that children execve directly instead of walking PATH (like bash's hash).
+static struct {
+    char* path_env;     // copy of the PATH the cache was built for. NULL if not built yet.
+    char* dirs_buffer;  // path_env split in place into the directories.
+    path_dir_t* dirs;
+    size_t dir_count;
+    path_cache_entry_t* buckets[PATH_CACHE_BUCKETS];
+} path_cache;
+
+static int pidfd_open_syscall(pid_t pid)
+{
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+/*
+ * Creates the epoll set of the reaper. Falls back to a signalfd (SIGCHLD blocked) if the kernel has no pidfd_open.
+*/
+int reaper_init(void)
+{
+    int probe_fd = -1;
+
+    reaper.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == reaper.epoll_fd) {
+        perror("epoll_create1 failed");
+        return GENERAL_FAILURE;
+    }
+
+    probe_fd = pidfd_open_syscall(getpid());
+    if (-1 != probe_fd) {
+        close(probe_fd);
+        return GENERAL_SUCCESS;
+    }
+
+    sigset_t sigchld_set;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };    // NULL marks the signalfd.
+    sigemptyset(&sigchld_set);
+    sigaddset(&sigchld_set, SIGCHLD);
+    if (-1 == sigprocmask(SIG_BLOCK, &sigchld_set, NULL)) {
+        perror("sigprocmask failed");
+        return GENERAL_FAILURE;
+    }
+    sigaddset(&wait_sigmask, SIGCHLD);  // read from the signalfd, even while waiting.
+    reaper.signal_fd = signalfd(-1, &sigchld_set, (SFD_NONBLOCK | SFD_CLOEXEC));
+    if (-1 == reaper.signal_fd) {
+        perror("signalfd failed");
+        return GENERAL_FAILURE;
+    }
+    if (-1 == epoll_ctl(reaper.epoll_fd, EPOLL_CTL_ADD, reaper.signal_fd, &event)) {
+        perror("epoll_ctl failed");
+        return GENERAL_FAILURE;
+    }
+    return GENERAL_SUCCESS;
+}
+
+void reaper_destroy(void)
+{
+    // children still running are not waited for, only forgotten.
+    while (NULL != reaper.children) {
+        child_record_t* child = reaper.children;
+        reaper.children = child->next;
+        if (-1 != child->pidfd) {
+            close(child->pidfd);
+        }
+    }
+    if (-1 != reaper.signal_fd) {
+        close(reaper.signal_fd);
+        reaper.signal_fd = -1;
+    }
+    if (-1 != reaper.epoll_fd) {
+        close(reaper.epoll_fd);
+        reaper.epoll_fd = -1;
+    }
+}
+
+/*
+ * Registers a launched child (child->pid set) so that the reaper collects its exit status.
+ * start_time is when its launch began - taken before launch_command, as the launch itself runs the child's execve.
+ * command and stage only describe the child for instrumentation.
+*/
+int reaper_watch(child_record_t* child, const struct timespec* start_time, const char* command, int stage)
+{
+    snprintf(child->command, sizeof(child->command), "%s", command);
+    child->stage = stage;
+    child->pidfd = -1;
+    child->is_reaped = false;
+    child->status = 0;
+    memset(&child->usage, 0, sizeof(child->usage));
+    child->start_time = *start_time;
+
+    if (-1 == reaper.signal_fd) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = child };
+        child->pidfd = pidfd_open_syscall(child->pid);
+        if (-1 == child->pidfd) {
+            perror("pidfd_open failed");
+            return GENERAL_FAILURE;
+        }
+        if (-1 == epoll_ctl(reaper.epoll_fd, EPOLL_CTL_ADD, child->pidfd, &event)) {
+            perror("epoll_ctl failed");
+            close(child->pidfd);
+            child->pidfd = -1;
+            return GENERAL_FAILURE;
+        }
+    }
+
+    child->next = reaper.children;
+    reaper.children = child;
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Unregisters a child without reaping it (used when its owner gives up on waiting). No-op for an unregistered child.
+*/
+void reaper_forget(child_record_t* child)
+{
+    child_record_t** link = &reaper.children;
+    while ((NULL != *link) && (child != *link)) {
+        link = &(*link)->next;
+    }
+    if (NULL != *link) {
+        *link = child->next;
+    }
+
+    if (-1 != child->pidfd) {
+        // a child that was just launched may still hold a copy of the pidfd (until its close-on-exec), which would keep
+        // the pidfd in the epoll set after close - remove it explicitly.
+        epoll_ctl(reaper.epoll_fd, EPOLL_CTL_DEL, child->pidfd, NULL);
+        close(child->pidfd);
+        child->pidfd = -1;
+    }
+}
+
+static double timespec_to_seconds(const struct timespec* time)
+{
+    return (double)time->tv_sec + ((double)time->tv_nsec / 1e9);
+}
+
+static double timeval_to_seconds(const struct timeval* time)
+{
+    return (double)time->tv_sec + ((double)time->tv_usec / 1e6);
+}
+
+/*
+ * Exit status of a reaped child, the way shells report it (128 + signal number for a killed child).
+*/
+int child_exit_status(const child_record_t* child)
+{
+    if (WIFEXITED(child->status)) {
+        return WEXITSTATUS(child->status);
+    }
+    if (WIFSIGNALED(child->status)) {
+        return 128 + WTERMSIG(child->status);
+    }
+    return 1;
+}
+
+/*
+ * The exit status of a (reaped) pipeline - that of its last stage, or with pipefail, that of the last stage that failed.
+ * A stage that was not launched has the status launch_pipeline gave it.
+*/
+int pipeline_status(const child_record_t* children, size_t count)
+{
+    if (is_pipefail) {
+        for (size_t i = count; i > 0; --i) {
+            if (0 != child_exit_status(&children[i - 1])) {
+                return child_exit_status(&children[i - 1]);
+            }
+        }
+    }
+    return child_exit_status(&children[count - 1]);
+}
+
+/*
+ * Writes a JSON line describing a reaped child to the trace fd. best effort - a failed write only loses the line.
+*/
+static void trace_child(const child_record_t* child)
+{
+    char command[2 * TRACE_COMMAND_SIZE];
+    char* line = NULL;
+    size_t length = 0;
+    int line_length = -1;
+
+    // escape for a JSON string. control characters are dropped, they cannot come from the tokenizer anyway.
+    for (const char* c = child->command; ('\0' != *c) && (length + 2 < sizeof(command)); ++c) {
+        if (('"' == *c) || ('\\' == *c)) {
+            command[length++] = '\\';
+            command[length++] = *c;
+        } else if ((unsigned char)*c >= 0x20) {
+            command[length++] = *c;
+        }
+    }
+    command[length] = '\0';
+
+    line_length = asprintf(&line,
+        "{\"pid\":%d,\"command\":\"%s\",\"stage\":%d,\"status\":%d,\"wall_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f,"
+        "\"maxrss_kb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld}\n",
+        child->pid, command, child->stage, child_exit_status(child),
+        timespec_to_seconds(&child->end_time) - timespec_to_seconds(&child->start_time),
+        timeval_to_seconds(&child->usage.ru_utime), timeval_to_seconds(&child->usage.ru_stime),
+        child->usage.ru_maxrss, child->usage.ru_nvcsw, child->usage.ru_nivcsw);
+    if (-1 == line_length) {
+        return;
+    }
+    write(trace_fd, line, line_length);    // a single write, so lines of concurrent writers do not interleave.
+    free(line);
+}
+
+static void reaper_collect(child_record_t* child, int status, const struct rusage* usage)
+{
+    reaper_forget(child);
+    clock_gettime(CLOCK_MONOTONIC, &child->end_time);
+    child->status = status;
+    child->usage = *usage;
+    child->is_reaped = true;
+    if (-1 != trace_fd) {
+        trace_child(child);
+    }
+}
+
+static child_record_t* reaper_find(pid_t pid)
+{
+    for (child_record_t* child = reaper.children; NULL != child; child = child->next) {
+        if (pid == child->pid) {
+            return child;
+        }
+    }
+    return NULL;
+}
+
+static void interrupt_handler(int signum)
+{
+    is_interrupt_pending = 1;
+}
+
+/*
+ * Forwards a pending SIGINT to the foreground pipelines - each is a process group of its own, outside the shell's,
+ * so one killpg reaches all of its stages. Background pipelines ignore SIGINT, and are not signaled.
+*/
+static void reaper_interrupt(void)
+{
+    pid_t signaled_pgid = 0;
+
+    is_interrupt_pending = 0;
+    interrupt_count++;
+    for (child_record_t* child = reaper.children; NULL != child; child = child->next) {
+        // the stages of a pipeline are watched one after the other, so a group is signaled once.
+        if (child->is_foreground && (0 < child->pgid) && (signaled_pgid != child->pgid)) {
+            killpg(child->pgid, SIGINT);    // best effort - the group may be gone already.
+            signaled_pgid = child->pgid;
+        }
+    }
+}
+
+/*
+ * Drops a SIGINT that arrived before now (e.g. a Ctrl-C at an idle prompt) - it is blocked outside of waits, and would
+ * otherwise reach whatever is launched or waited for next. Called before a launch or a wait of a builtin.
+*/
+static void interrupt_discard(void)
+{
+    sigset_t interrupt_set;
+    const struct timespec no_wait = {0};
+
+    sigemptyset(&interrupt_set);
+    sigaddset(&interrupt_set, SIGINT);
+    while (SIGINT == sigtimedwait(&interrupt_set, NULL, &no_wait)) {}
+    is_interrupt_pending = 0;
+}
+
+/*
+ * Waits up to timeout milliseconds (-1 forever, 0 not at all) for children to exit, and reaps every child that did.
+*/
+int reaper_poll(int timeout)
+{
+    struct epoll_event events[REAPER_MAX_EVENTS];
+    int event_count = 0;
+
+    // SIGINT can only be caught during the wait, which it interrupts - it is not left pending until a child exits.
+    event_count = epoll_pwait(reaper.epoll_fd, events, REAPER_MAX_EVENTS, timeout, &wait_sigmask);
+    if (is_interrupt_pending) {
+        reaper_interrupt();
+    }
+    if (-1 == event_count) {
+        if (EINTR == errno) {
+            return GENERAL_SUCCESS; // the caller polls again.
+        }
+        perror("epoll_wait failed");
+        return GENERAL_FAILURE;
+    }
+
+    for (int i = 0; i < event_count; ++i) {
+        child_record_t* child = (child_record_t*)events[i].data.ptr;
+        struct rusage usage = {0};
+        int status = 0;
+        pid_t pid = -1;
+
+        if ((void*)&reaper.input_fd == events[i].data.ptr) {
+            reaper.is_input_ready = true;   // disarmed until the next wait_for_input.
+            continue;
+        }
+        if (NULL != child) {
+            // pidfd became readable - the child exited.
+            pid = wait4(child->pid, &status, WNOHANG, &usage);
+            if ((-1 == pid) && (ECHILD != errno)) {
+                perror("wait4 failed");
+                return GENERAL_FAILURE;
+            }
+            if (0 != pid) {
+                reaper_collect(child, status, &usage);
+            }
+            continue;
+        }
+
+        // SIGCHLD signalfd - signals coalesce, so drain it and reap every exited child.
+        struct signalfd_siginfo info;
+        while (sizeof(info) == read(reaper.signal_fd, &info, sizeof(info))) {}
+        while (0 < (pid = wait4(-1, &status, WNOHANG, &usage))) {
+            child = reaper_find(pid);
+            if (NULL != child) {
+                reaper_collect(child, status, &usage);
+            }
+        }
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Waits until fd (the shell's input) is readable, reaping the children that exit meanwhile - so that a background job is
+ * reaped (and its end time taken) when it exits, rather than when the next command line is read.
+ * returns GENERAL_SUCCESS once fd is readable (or cannot be polled, e.g. a regular file).
+*/
+int wait_for_input(int fd)
+{
+    struct epoll_event event = { .events = (EPOLLIN | EPOLLONESHOT), .data.ptr = &reaper.input_fd };
+
+    if (fd != reaper.input_fd) {
+        if (-1 != reaper.input_fd) {
+            epoll_ctl(reaper.epoll_fd, EPOLL_CTL_DEL, reaper.input_fd, NULL);   // best effort - may be closed already.
+        }
+        if (-1 == epoll_ctl(reaper.epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+            reaper.input_fd = -1;
+            return GENERAL_SUCCESS;     // never blocks (EPERM), or the read reports the failure.
+        }
+        reaper.input_fd = fd;
+    } else if (-1 == epoll_ctl(reaper.epoll_fd, EPOLL_CTL_MOD, fd, &event)) {
+        perror("epoll_ctl failed");
+        return GENERAL_FAILURE;
+    }
+
+    reaper.is_input_ready = false;
+    while (!reaper.is_input_ready) {
+        if (GENERAL_SUCCESS != reaper_poll(-1)) {
+            return GENERAL_FAILURE;
+        }
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Waits until the (watched) child is reaped. Other children that exit meanwhile are reaped as well.
+*/
+int reaper_wait(child_record_t* child)
+{
+    while (!child->is_reaped) {
+        if (GENERAL_SUCCESS != reaper_poll(-1)) {
+            return GENERAL_FAILURE;
+        }
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Waits for all the children (of a pipeline) to complete, in whatever order they exit. pid -1 means not launched.
+*/
+int wait_children(child_record_t* children, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if ((-1 != children[i].pid) && (GENERAL_SUCCESS != reaper_wait(&children[i]))) {
+            return GENERAL_FAILURE;
+        }
+    }
+    return GENERAL_SUCCESS;
+}
+
+static void cgroup_name(unsigned long serial, char* name, size_t name_size)
+{
+    snprintf(name, name_size, "myshell-%d-%lu", (int)getpid(), serial);
+}
+
+static int write_cgroup_file(int dir_fd, const char* file, const char* value)
+{
+    size_t length = strlen(value);
+    int fd = openat(dir_fd, file, (O_WRONLY | O_CLOEXEC));
+
+    if (-1 == fd) {
+        return GENERAL_FAILURE;
+    }
+    if ((ssize_t)length != write(fd, value, length)) {
+        int write_errno = errno;
+        close(fd);
+        errno = write_errno;
+        return GENERAL_FAILURE;
+    }
+    close(fd);
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Creates a cgroup leaf for a pipeline, with the configured limits, owned by the record of its last stage.
+ * returns GENERAL_FAILURE (printed) if it cannot - the pipeline is then dropped rather than run unlimited.
+*/
+static int cgroup_create(child_record_t* owner)
+{
+    const struct {
+        const char* file;
+        const char* value;
+    } limits[] = {
+        { "cpu.max", cgroups.cpu_max }, { "memory.max", cgroups.memory_max }, { "io.max", cgroups.io_max },
+    };
+    char name[CGROUP_NAME_SIZE];
+    int leaf_fd = -1;
+
+    owner->cgroup_serial = cgroups.next_serial++;
+    cgroup_name(owner->cgroup_serial, name, sizeof(name));
+    if (-1 == mkdirat(cgroups.parent_fd, name, (S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH))) {
+        perror("cgroup mkdir failed");
+        return GENERAL_FAILURE;
+    }
+    leaf_fd = openat(cgroups.parent_fd, name, (O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (-1 == leaf_fd) {
+        perror("cgroup open failed");
+        goto fail;
+    }
+    for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); ++i) {
+        if ((NULL != limits[i].value) && (GENERAL_SUCCESS != write_cgroup_file(leaf_fd, limits[i].file, limits[i].value))) {
+            fprintf(stderr, "cgroup: %s %s: %s\n", limits[i].file, limits[i].value, strerror(errno));
+            goto fail;
+        }
+    }
+    owner->cgroup_fd = leaf_fd;
+    return GENERAL_SUCCESS;
+
+fail:
+    if (-1 != leaf_fd) {
+        close(leaf_fd);
+    }
+    unlinkat(cgroups.parent_fd, name, AT_REMOVEDIR);
+    return GENERAL_FAILURE;
+}
+
+/*
+ * Reads the CPU time (cpu.stat usage_usec) and peak memory (memory.peak, -1 if the memory controller is off) of a leaf.
+*/
+static int cgroup_read_usage(int leaf_fd, double* cpu_seconds, long* memory_peak_kb)
+{
+    char buffer[CGROUP_STAT_SIZE];
+    ssize_t length = 0;
+    const char* found = NULL;
+    int fd = openat(leaf_fd, "cpu.stat", (O_RDONLY | O_CLOEXEC));
+
+    if (-1 == fd) {
+        return GENERAL_FAILURE;
+    }
+    length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (0 > length) {
+        return GENERAL_FAILURE;
+    }
+    buffer[length] = '\0';
+    found = strstr(buffer, "usage_usec ");
+    *cpu_seconds = (NULL != found) ? (strtoull(found + strlen("usage_usec "), NULL, 10) / 1e6) : 0;
+
+    *memory_peak_kb = -1;
+    fd = openat(leaf_fd, "memory.peak", (O_RDONLY | O_CLOEXEC));
+    if (-1 != fd) {
+        length = read(fd, buffer, sizeof(buffer) - 1);
+        if (0 < length) {
+            buffer[length] = '\0';
+            *memory_peak_kb = (long)(strtoull(buffer, NULL, 10) / 1024);
+        }
+        close(fd);
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Once its pipeline is done - reads back the usage of the leaf (to the trace, if on), and removes it.
+ * No-op for a record that owns no leaf.
+*/
+static void cgroup_release(child_record_t* owner)
+{
+    char name[CGROUP_NAME_SIZE];
+    double cpu_seconds = 0;
+    long memory_peak_kb = -1;
+
+    if (-1 == owner->cgroup_fd) {
+        return;
+    }
+    cgroup_name(owner->cgroup_serial, name, sizeof(name));
+    if ((-1 != trace_fd) && (GENERAL_SUCCESS == cgroup_read_usage(owner->cgroup_fd, &cpu_seconds, &memory_peak_kb))) {
+        dprintf(trace_fd, "{\"cgroup\":\"%s\",\"pgid\":%d,\"cpu_s\":%.6f,\"memory_peak_kb\":%ld}\n",
+                name, (int)owner->pgid, cpu_seconds, memory_peak_kb);
+    }
+    close(owner->cgroup_fd);
+    owner->cgroup_fd = -1;
+    // best effort - fails while a process that the pipeline left behind still runs in it.
+    unlinkat(cgroups.parent_fd, name, AT_REMOVEDIR);
+}
+
+/*
+ * Rebuilds the command line of a classified command, e.g. "a x | b < in". returns NULL if out of memory.
+*/
+char* join_command(const command_t* command)
+{
+    size_t length = 1;
+    char* joined = NULL;
+    char* end = NULL;
+
+    for (size_t i = 0; i < command->stage_count; ++i) {
+        for (int j = 0; j < command->stages[i].argc; ++j) {
+            length += strlen(command->stages[i].argv[j]) + 3;   // room for " | " as well.
+        }
+    }
+    if (NULL != command->input_path) {
+        length += strlen(command->input_path) + 3;
+    }
+    if (NULL != command->output_path) {
+        length += strlen(command->output_path) + 4;
+    }
+    if (NULL != command->error_path) {
+        length += strlen(command->error_path) + 4;
+    }
+    length += 5 * (command->stage_count + 1);   // " 2>&1" after any stage, and before the output redirection.
+
+    joined = (char*)malloc(length);
+    if (NULL == joined) {
+        return NULL;
+    }
+
+    end = joined;
+    *end = '\0';
+    for (size_t i = 0; i < command->stage_count; ++i) {
+        if (0 != i) {
+            end = stpcpy(end, " | ");
+        }
+        for (int j = 0; j < command->stages[i].argc; ++j) {
+            if (0 != j) {
+                *end++ = ' ';
+            }
+            end = stpcpy(end, command->stages[i].argv[j]);
+        }
+        if ((0 == i) && (NULL != command->input_path)) {
+            end = stpcpy(stpcpy(end, " < "), command->input_path);  // feeds the first stage.
+        }
+        if ((i + 1 < command->stage_count) && command->stages[i].is_error_to_output) {
+            end = stpcpy(end, " 2>&1");
+        }
+    }
+    if (command->is_error_to_original_output) {
+        end = stpcpy(end, " 2>&1");
+    }
+    if (NULL != command->output_path) {
+        end = stpcpy(stpcpy(end, command->is_append ? " >> " : " > "), command->output_path);
+    }
+    if (NULL != command->error_path) {
+        end = stpcpy(stpcpy(end, " 2> "), command->error_path);
+    }
+    if (command->stages[command->stage_count - 1].is_error_to_output) {
+        end = stpcpy(end, " 2>&1");
+    }
+    return joined;
+}
+
+/*
+ * Allocates a job for the command line, not yet in the job table (see job_add).
+*/
+job_t* job_create(const command_t* command)
+{
+    job_t* job = (job_t*)calloc(1, sizeof(job_t));
+    if (NULL == job) {
+        return NULL;
+    }
+    job->capture_fd = -1;
+    job->command_line = join_command(command);
+    job->children = (child_record_t*)calloc(command->stage_count, sizeof(child_record_t));
+    if ((NULL == job->command_line) || (NULL == job->children)) {
+        free(job->command_line);
+        free(job->children);
+        free(job);
+        return NULL;
+    }
+    job->child_count = command->stage_count;
+    for (size_t i = 0; i < job->child_count; ++i) {
+        job->children[i].pid = -1;
+        job->children[i].pidfd = -1;
+        job->children[i].cgroup_fd = -1;
+    }
+    return job;
+}
+
+void job_free(job_t* job)
+{
+    for (size_t i = 0; i < job->child_count; ++i) {
+        reaper_forget(&job->children[i]);
+    }
+    cgroup_release(&job->children[job->child_count - 1]);
+    if (-1 != job->capture_fd) {
+        close(job->capture_fd);
+    }
+    free(job->children);
+    free(job->command_line);
+    free(job);
+}
+
+bool job_is_launched(const job_t* job)
+{
+    for (size_t i = 0; i < job->child_count; ++i) {
+        if (-1 != job->children[i].pid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the process group of the job's pipeline, 0 if nothing was launched.
+pid_t job_pgid(const job_t* job)
+{
+    return job->children[job->child_count - 1].pgid;   // set on every stage once its group leader is known.
+}
+
+int job_exit_status(const job_t* job)
+{
+    return pipeline_status(job->children, job->child_count);
+}
+
+bool job_is_done(const job_t* job)
+{
+    for (size_t i = 0; i < job->child_count; ++i) {
+        if ((-1 != job->children[i].pid) && !job->children[i].is_reaped) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void job_add(job_t* job)
+{
+    job->id = jobs.next_id++;
+    job->next = NULL;
+    if (NULL == jobs.tail) {
+        jobs.head = job;
+    } else {
+        jobs.tail->next = job;
+    }
+    jobs.tail = job;
+}
+
+void job_remove(job_t* job)
+{
+    job_t* prev = NULL;
+    for (job_t* current = jobs.head; NULL != current; prev = current, current = current->next) {
+        if (job != current) {
+            continue;
+        }
+        if (NULL == prev) {
+            jobs.head = job->next;
+        } else {
+            prev->next = job->next;
+        }
+        if (jobs.tail == job) {
+            jobs.tail = prev;
+        }
+        break;
+    }
+    if (NULL == jobs.head) {
+        jobs.next_id = 1;   // like bash, ids start over once the table is empty.
+    }
+    job_free(job);
+}
+
+void jobs_destroy(void)
+{
+    while (NULL != jobs.head) {
+        job_remove(jobs.head);
+    }
+}
+
+/*
+ * Finds a job by "N" or "%N". NULL id means the most recent job.
+*/
+job_t* job_find(const char* id)
+{
+    char* end = NULL;
+    long number = 0;
+
+    if (NULL == id) {
+        return jobs.tail;
+    }
+    if ('%' == *id) {
+        id++;
+    }
+    number = strtol(id, &end, 10);
+    if ((end == id) || ('\0' != *end)) {
+        return NULL;
+    }
+    for (job_t* job = jobs.head; NULL != job; job = job->next) {
+        if (number == job->id) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// the operators - a word that is exactly one of them has its kind (see process_tokenized_arglist), like the tokenizer's.
+static const struct {
+    const char* word;
+    char kind;
+} operators[] = {
+    { "|", '|' }, { "&", '&' }, { "<", '<' }, { ">", '>' }, { "&&", 'A' }, { "||", 'O' },
+    { ">>", 'a' }, { "2>", 'e' }, { "2>&1", 'd' }, { "&>", 'b' },
+};
+
+static char word_kind(const char* word)
+{
+    if (NULL == strchr("|&<>2", word[0])) {
+        return '\0';   // most words.
+    }
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); ++i) {
+        if (0 == strcmp(word, operators[i].word)) {
+            return operators[i].kind;
+        }
+    }
+    return '\0';
+}
+
+static pipeline_stage_t* add_stage(command_t* command, char** argv)
+{
+    pipeline_stage_t* stage = NULL;
+
+    if (command->stage_count == command->stage_capacity) {
+        // grow geometrically - pipelines have no length limit.
+        size_t new_capacity = (0 == command->stage_capacity) ? INITIAL_PIPELINE_CAPACITY : (2 * command->stage_capacity);
+        pipeline_stage_t* new_stages = (pipeline_stage_t*)realloc(command->stages, new_capacity * sizeof(pipeline_stage_t));
+        if (NULL == new_stages) {
+            perror("realloc failed");
+            return NULL;
+        }
+        command->stages = new_stages;
+        // no record is watched between command lines, so the records may move.
+        child_record_t* new_children = (child_record_t*)realloc(command->children, new_capacity * sizeof(child_record_t));
+        if (NULL == new_children) {
+            perror("realloc failed");
+            return NULL;
+        }
+        command->children = new_children;
+        command->stage_capacity = new_capacity;
+    }
+
+    command->children[command->stage_count].pid = -1;
+    command->children[command->stage_count].pidfd = -1;
+    command->children[command->stage_count].cgroup_fd = -1;
+    stage = &command->stages[command->stage_count++];
+    stage->argv = argv;
+    stage->argc = 0;
+    stage->is_error_to_output = false;
+    return stage;
+}
+
+/*
+ * Classifies a command line in a single pass over its words (kinds as found by the tokenizer).
+ * Splits it into pipeline stages and takes out the redirection targets and the background "&". arglist is compacted
+ * in place, so each stage argv holds only its words, NULL terminated.
+ * The operations combine - "a < in | b | c > out &" is a single command line. An input redirection belongs to the first
+ * stage and the output and error file redirections to the last one, anywhere else they are a syntax error. "2>&1" may
+ * follow any stage - before a "|" it sends the stage's STDERR into the pipe, as in "a 2>&1 | grep x".
+ * Redirections apply left to right - "2>&1 > out" leaves STDERR on the STDOUT from before, "> out 2>&1" sends both to out.
+ * returns COMMAND_SYNTAX_ERROR (printed) for an invalid line, GENERAL_FAILURE if out of memory.
+*/
+int classify_command(int count, char** arglist, const char* kinds, command_t* command)
+{
+    pipeline_stage_t* stage = NULL;
+    bool has_file_redirection = false;  // ">", ">>", "2>" or "&>" - the current stage must be the last one.
+    int words = 0;  // compacted length of arglist.
+
+    command->stage_count = 0;
+    command->input_path = NULL;
+    command->output_path = NULL;
+    command->is_append = false;
+    command->error_path = NULL;
+    command->is_error_to_original_output = false;
+    command->is_background = false;
+
+    stage = add_stage(command, arglist);
+    if (NULL == stage) {
+        return GENERAL_FAILURE;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        switch (kinds[i]) {
+        case '|':
+            if ((0 == stage->argc) || has_file_redirection) {
+                goto syntax_error;
+            }
+            arglist[words++] = NULL;
+            stage = add_stage(command, &arglist[words]);
+            if (NULL == stage) {
+                return GENERAL_FAILURE;
+            }
+            break;
+        case '&':
+            // If a command line contains the & symbol, then it is the last word of the command line.
+            if (i != count - 1) {
+                goto syntax_error;
+            }
+            command->is_background = true;
+            break;
+        case 'A':
+        case 'O':
+            goto syntax_error;  // and-or lists are split by the caller.
+        case 'd':
+            // "2>&1" - no filename. copies STDOUT of the stage as it is at this point, see the output redirections.
+            if (stage->is_error_to_output || command->is_error_to_original_output || (NULL != command->error_path)) {
+                goto syntax_error;
+            }
+            stage->is_error_to_output = true;  // redirects nothing to a file - any stage may have it.
+            break;
+        case '<':
+        case '>':
+        case 'a':
+        case 'e':
+        case 'b':
+            // the next word is the filename.
+            if ((i + 1 == count) || ('\0' != kinds[i + 1])) {
+                goto syntax_error;
+            }
+            if ('<' == kinds[i]) {
+                if ((NULL != command->input_path) || (1 != command->stage_count)) {
+                    goto syntax_error;
+                }
+                command->input_path = arglist[++i];
+                break;
+            }
+            has_file_redirection = true;
+            if ('e' == kinds[i]) {
+                if ((NULL != command->error_path) || stage->is_error_to_output || command->is_error_to_original_output) {
+                    goto syntax_error;
+                }
+                command->error_path = arglist[++i];
+            } else {
+                bool has_error_redirection = (NULL != command->error_path) || stage->is_error_to_output;
+                if ((NULL != command->output_path) || (('b' == kinds[i]) && has_error_redirection)) {
+                    goto syntax_error;
+                }
+                // an earlier "2>&1" copied STDOUT before this redirection - it keeps the original one.
+                command->is_error_to_original_output = stage->is_error_to_output;
+                stage->is_error_to_output = ('b' == kinds[i]);
+                command->output_path = arglist[++i];
+                command->is_append = ('a' == kinds[i - 1]);
+            }
+            break;
+        default:
+            arglist[words++] = arglist[i];
+            stage->argc++;
+            break;
+        }
+    }
+    arglist[words] = NULL;
+
+    if (0 == stage->argc) {
+        goto syntax_error;
+    }
+    return GENERAL_SUCCESS;
+
+syntax_error:
+    fprintf(stderr, "Error: syntax error.\n");
+    return COMMAND_SYNTAX_ERROR;
+}
+
+static size_t path_cache_hash(const char* name)
+{
+    // FNV-1a
+    size_t hash = 2166136261u;
+    for (; '\0' != *name; ++name) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash % PATH_CACHE_BUCKETS;
+}
+
+static void path_cache_clear_entries(void)
+{
+    for (size_t i = 0; i < PATH_CACHE_BUCKETS; ++i) {
+        path_cache_entry_t* entry = path_cache.buckets[i];
+        while (NULL != entry) {
+            path_cache_entry_t* next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        path_cache.buckets[i] = NULL;
+    }
+}
+
+void path_cache_reset(void)
+{
+    path_cache_clear_entries();
+    free(path_cache.path_env);
+    free(path_cache.dirs_buffer);
+    free(path_cache.dirs);
+    path_cache.path_env = NULL;
+    path_cache.dirs_buffer = NULL;
+    path_cache.dirs = NULL;
+    path_cache.dir_count = 0;
+}
+
+static struct timespec get_dir_mtime(const char* dir)
+{
+    struct stat dir_stat;
+    struct timespec mtime = {0};    // a missing directory is recorded as mtime 0, so creating it invalidates the cache.
+    if (0 == stat(dir, &dir_stat)) {
+        mtime = dir_stat.st_mtim;
+    }
+    return mtime;
+}
+
+static bool is_path_dir_unchanged(size_t dir_index)
+{
+    struct timespec mtime = get_dir_mtime(path_cache.dirs[dir_index].dir);
+    return (mtime.tv_sec == path_cache.dirs[dir_index].mtime.tv_sec) && (mtime.tv_nsec == path_cache.dirs[dir_index].mtime.tv_nsec);
+}
+
+static void path_cache_snapshot_dirs(void)
+{
+    for (size_t i = 0; i < path_cache.dir_count; ++i) {
+        path_cache.dirs[i].mtime = get_dir_mtime(path_cache.dirs[i].dir);
+    }
+}
+
+/*
+ * (Re)builds the directory list of the cache for path_env. Drops all cached entries.
+*/
+static int path_cache_load(const char* path_env)
+{
+    size_t dir_count = 1;
+    char* dir = NULL;
+
+    path_cache_reset();
+
+    for (const char* c = path_env; '\0' != *c; ++c) {
+        if (':' == *c) {
+            dir_count++;
+        }
+    }
+
+    path_cache.path_env = strdup(path_env);
+    path_cache.dirs_buffer = strdup(path_env);
+    path_cache.dirs = (path_dir_t*)calloc(dir_count, sizeof(path_dir_t));
+    if ((NULL == path_cache.path_env) || (NULL == path_cache.dirs_buffer) || (NULL == path_cache.dirs)) {
+        path_cache_reset();
+        return GENERAL_FAILURE;
+    }
+
+    // split in place. an empty entry in PATH means the current directory.
+    dir = path_cache.dirs_buffer;
+    for (size_t i = 0; i < dir_count; ++i) {
+        char* separator = strchr(dir, ':');
+        if (NULL != separator) {
+            *separator = '\0';
+        }
+        path_cache.dirs[i].dir = ('\0' == *dir) ? "." : dir;
+        dir = separator + 1;
+    }
+    path_cache.dir_count = dir_count;
+    path_cache_snapshot_dirs();
+
+    return GENERAL_SUCCESS;
+}
+
+static path_cache_entry_t* path_cache_find(const char* name, path_cache_entry_t*** bucket)
+{
+    *bucket = &path_cache.buckets[path_cache_hash(name)];
+    for (path_cache_entry_t* entry = **bucket; NULL != entry; entry = entry->next) {
+        if (0 == strcmp(entry->name, name)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the path to execute for the command name, searching PATH only on a cache miss.
+ * A hit is valid as long as PATH is the same and none of the directories up to (and including) the one it was found in changed,
+ * since only those can shadow or remove it.
+ * returns NULL and sets errno if the command was not found.
+*/
+const char* resolve_command_path(const char* name)
+{
+    const char* path_env = getenv("PATH");
+    path_cache_entry_t** bucket = NULL;
+    path_cache_entry_t* entry = NULL;
+    char* candidate = NULL;
+
+    if (NULL != strchr(name, '/')) {
+        return name;    // not searched in PATH, just like execvp.
+    }
+
+    if (NULL == path_env) {
+        path_env = DEFAULT_PATH;
+    }
+    if ((NULL == path_cache.path_env) || (0 != strcmp(path_cache.path_env, path_env))) {
+        if (GENERAL_SUCCESS != path_cache_load(path_env)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    entry = path_cache_find(name, &bucket);
+    if (NULL != entry) {
+        bool is_valid = true;
+        for (size_t i = 0; is_valid && (i <= entry->dir_index); ++i) {
+            is_valid = is_path_dir_unchanged(i);
+        }
+        if (is_valid) {
+            entry->hits++;
+            return entry->path;
+        }
+
+        // a PATH directory changed, every entry may be stale.
+        path_cache_clear_entries();
+        path_cache_snapshot_dirs();
+    }
+
+    for (size_t i = 0; i < path_cache.dir_count; ++i) {
+        struct stat file_stat;
+        if (-1 == asprintf(&candidate, "%s/%s", path_cache.dirs[i].dir, name)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        if ((0 == stat(candidate, &file_stat)) && S_ISREG(file_stat.st_mode) && (0 == access(candidate, X_OK))) {
+            entry = (path_cache_entry_t*)malloc(sizeof(path_cache_entry_t));
+            if ((NULL == entry) || (NULL == (entry->name = strdup(name)))) {
+                free(entry);
+                free(candidate);
+                errno = ENOMEM;
+                return NULL;
+            }
+            entry->path = candidate;
+            entry->dir_index = i;
+            entry->hits = 1;
+            entry->next = *bucket;
+            *bucket = entry;
+            return entry->path;
+        }
+
+        free(candidate);
+        candidate = NULL;
+    }
+
+    errno = ENOENT;
+    return NULL;
+}
+
+/*
+ * hash [-r] [name...] - print the cached command paths, reset the cache (-r), or look up names and cache them.
+*/
+int run_hash_builtin(int count, char** arglist)
+{
+    int status = 0;
+
+    if (1 == count) {
+        bool is_empty = true;
+        for (size_t i = 0; i < PATH_CACHE_BUCKETS; ++i) {
+            for (path_cache_entry_t* entry = path_cache.buckets[i]; NULL != entry; entry = entry->next) {
+                if (is_empty) {
+                    printf("hits\tcommand\n");
+                    is_empty = false;
+                }
+                printf("%4u\t%s\n", entry->hits, entry->path);
+            }
+        }
+        if (is_empty) {
+            printf("hash: hash table empty\n");
+        }
+        return status;
+    }
+
+    for (int i = 1; i < count; ++i) {
+        if (0 == strcmp(arglist[i], "-r")) {
+            path_cache_reset();
+        } else if (NULL == resolve_command_path(arglist[i])) {
+            fprintf(stderr, "hash: %s: not found\n", arglist[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/*
+ * Parses a byte count with an optional k/m/g (binary) suffix, e.g. "1m".
+*/
+static int parse_size(const char* text, size_t* size)
+{
+    char* end = NULL;
+    unsigned long long value = 0;
+
+    errno = 0;
+    value = strtoull(text, &end, 10);
+    if ((0 != errno) || (end == text) || ('-' == *text)) {
+        return GENERAL_FAILURE;
+    }
+
+    switch (*end) {
+    case 'g': case 'G':
+        value <<= 10;
+        // fall through
+    case 'm': case 'M':
+        value <<= 10;
+        // fall through
+    case 'k': case 'K':
+        value <<= 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if ('\0' != *end) {
+        return GENERAL_FAILURE;
+    }
+
+    *size = (size_t)value;
+    return GENERAL_SUCCESS;
+}
+
+static void read_pipe_max_size(void)
+{
+    FILE* file = fopen(PIPE_MAX_SIZE_FILE, "r");
+    unsigned long value = 0;
+
+    if (NULL == file) {
+        return; // unknown - leave it to F_SETPIPE_SZ to refuse - best effort.
+    }
+    if (1 == fscanf(file, "%lu", &value)) {
+        pipe_max_size = (size_t)value;
+    }
+    fclose(file);
+}
+
+/*
+ * Enables instrumentation if MYSHELL_TRACE_FD names an open fd. An invalid value is reported and ignored.
+*/
+static void init_trace_fd(void)
+{
+    const char* text = getenv(TRACE_FD_ENV);
+    char* end = NULL;
+    long fd = -1;
+
+    if (NULL == text) {
+        return;
+    }
+    fd = strtol(text, &end, 10);
+    if ((end == text) || ('\0' != *end) || (fd < 0) || (fd > INT32_MAX) || (-1 == fcntl((int)fd, F_GETFD))) {
+        fprintf(stderr, "Error: %s is not an open fd, instrumentation disabled.\n", TRACE_FD_ENV);
+        return;
+    }
+    trace_fd = (int)fd;
+}
+
+/*
+ * Sets the capacity of the pipes created for following pipelines. 0 restores the kernel default.
+ * Sizes above pipe-max-size are clamped to it, since unprivileged processes may not exceed it.
+*/
+int set_pipe_buffer_size(const char* text)
+{
+    size_t size = 0;
+
+    if (GENERAL_SUCCESS != parse_size(text, &size)) {
+        fprintf(stderr, "Error: invalid pipe size '%s'.\n", text);
+        return GENERAL_FAILURE;
+    }
+
+    if ((0 != pipe_max_size) && (size > pipe_max_size)) {
+        fprintf(stderr, "pipe size %zu exceeds %s, using %zu.\n", size, PIPE_MAX_SIZE_FILE, pipe_max_size);
+        size = pipe_max_size;
+    }
+    pipe_buffer_size = size;
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * pipesize [bytes] - print or set the capacity of pipes between pipeline stages. 0 restores the kernel default.
+*/
+int run_pipesize_builtin(int count, char** arglist)
+{
+    if (1 == count) {
+        if (0 == pipe_buffer_size) {
+            printf("default\n");
+        } else {
+            printf("%zu\n", pipe_buffer_size);
+        }
+        return 0;
+    }
+
+    return (GENERAL_SUCCESS == set_pipe_buffer_size(arglist[1])) ? 0 : 1;
+}
+
+/*
+ * Parses a CPU list, e.g. "0-3,8,10-11" (the format of taskset -c and of the cpulist files in sysfs).
+*/
+static int parse_cpu_list(const char* text, cpu_set_t* set)
+{
+    const char* c = text;
+
+    CPU_ZERO(set);
+    while ('\0' != *c) {
+        char* end = NULL;
+        unsigned long first = strtoul(c, &end, 10);
+        unsigned long last = first;
+        if ((end == c) || ('-' == *c)) {
+            return GENERAL_FAILURE;
+        }
+        c = end;
+        if ('-' == *c) {
+            last = strtoul(++c, &end, 10);
+            if ((end == c) || ('-' == *c) || (last < first)) {
+                return GENERAL_FAILURE;
+            }
+            c = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return GENERAL_FAILURE;
+        }
+        for (unsigned long cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, set);
+        }
+        if ((',' == *c) && ('\0' != c[1])) {
+            c++;
+        } else if (('\0' != *c) && ('\n' != *c)) {
+            return GENERAL_FAILURE;
+        } else {
+            break;
+        }
+    }
+    return (0 != CPU_COUNT(set)) ? GENERAL_SUCCESS : GENERAL_FAILURE;
+}
+
+static int read_node_cpus(int node, cpu_set_t* set)
+{
+    char path[sizeof(NODE_CPULIST_FORMAT) + 16];
+    char list[1024];
+    ssize_t length = -1;
+    int fd = -1;
+
+    snprintf(path, sizeof(path), NODE_CPULIST_FORMAT, node);
+    fd = open(path, (O_RDONLY | O_CLOEXEC));
+    if (-1 == fd) {
+        return GENERAL_FAILURE;
+    }
+    length = read(fd, list, sizeof(list) - 1);
+    close(fd);
+    if (0 >= length) {
+        return GENERAL_FAILURE;
+    }
+    list[length] = '\0';
+    return parse_cpu_list(list, set);  // fails for a node without CPUs (memory only).
+}
+
+/*
+ * Sets where the children of the following pipelines run, pinned before execve:
+ * none, mask:LIST (those CPUs), node:N (the CPUs of NUMA node N), node (each pipeline on the next node, round-robin)
+ * or spread (each pipeline on the next CPU of the shell, round-robin - e.g. one per -j worker).
+ * All the stages of a pipeline share its CPUs, so they pass data through a cache (or at least a node) they share.
+*/
+int set_cpu_policy(const char* text)
+{
+    char kind = '\0';
+    char* copy = NULL;
+    int node = 0;
+    char* end = NULL;
+
+    if (0 == strcmp(text, "none")) {
+        kind = '\0';
+    } else if (0 == strncmp(text, "mask:", strlen("mask:"))) {
+        if (GENERAL_SUCCESS != parse_cpu_list(text + strlen("mask:"), &cpu_policy.mask)) {
+            goto invalid;
+        }
+        kind = 'f';
+    } else if (0 == strncmp(text, "node:", strlen("node:"))) {
+        node = (int)strtol(text + strlen("node:"), &end, 10);
+        if ((end == text + strlen("node:")) || ('\0' != *end) || (node < 0) ||
+            (GENERAL_SUCCESS != read_node_cpus(node, &cpu_policy.mask))) {
+            fprintf(stderr, "Error: no CPUs on NUMA node '%s'.\n", text + strlen("node:"));
+            return GENERAL_FAILURE;
+        }
+        kind = 'f';
+    } else if (0 == strcmp(text, "node")) {
+        cpu_policy.node_count = 0;
+        for (node = 0; (node < CPU_POLICY_MAX_NODES) && (cpu_policy.node_count < CPU_POLICY_MAX_NODES); ++node) {
+            if (GENERAL_SUCCESS == read_node_cpus(node, &cpu_policy.nodes[cpu_policy.node_count])) {
+                cpu_policy.node_count++;
+            }
+        }
+        if (0 == cpu_policy.node_count) {
+            fprintf(stderr, "Error: no NUMA nodes found.\n");
+            return GENERAL_FAILURE;
+        }
+        kind = 'n';
+    } else if (0 == strcmp(text, "spread")) {
+        if (-1 == sched_getaffinity(0, sizeof(cpu_policy.mask), &cpu_policy.mask)) {
+            perror("sched_getaffinity failed");
+            return GENERAL_FAILURE;
+        }
+        kind = 's';
+    } else {
+        goto invalid;
+    }
+
+    if ('\0' != kind) {
+        copy = strdup(text);
+        if (NULL == copy) {
+            perror("strdup failed");
+            return GENERAL_FAILURE;
+        }
+    }
+    free(cpu_policy.text);
+    cpu_policy.text = copy;
+    cpu_policy.kind = kind;
+    cpu_policy.next = 0;
+    return GENERAL_SUCCESS;
+
+invalid:
+    fprintf(stderr, "Error: invalid CPU policy '%s'.\n", text);
+    return GENERAL_FAILURE;
+}
+
+/*
+ * The CPUs of the next pipeline under the policy. returns false if its children inherit the shell's.
+*/
+static bool next_pipeline_affinity(cpu_set_t* set)
+{
+    switch (cpu_policy.kind) {
+    case 'f':
+        *set = cpu_policy.mask;
+        return true;
+    case 'n':
+        *set = cpu_policy.nodes[cpu_policy.next];
+        cpu_policy.next = (cpu_policy.next + 1) % cpu_policy.node_count;
+        return true;
+    case 's':
+        // the mask is not empty, so this finds a CPU within a round.
+        for (int i = 0; i < CPU_SETSIZE; ++i) {
+            int cpu = (cpu_policy.next + i) % CPU_SETSIZE;
+            if (CPU_ISSET(cpu, &cpu_policy.mask)) {
+                CPU_ZERO(set);
+                CPU_SET(cpu, set);
+                cpu_policy.next = cpu + 1;
+                return true;
+            }
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+/*
+ * cpupolicy [none | mask:LIST | node:N | node | spread] - print or set where the children of following pipelines run.
+*/
+int run_cpupolicy_builtin(int count, char** arglist)
+{
+    if (1 == count) {
+        printf("%s\n", (NULL != cpu_policy.text) ? cpu_policy.text : "none");
+        return 0;
+    }
+
+    return (GENERAL_SUCCESS == set_cpu_policy(arglist[1])) ? 0 : 1;
+}
+
+/*
+ * Opens the "<" target of the command (command->input_path).
+ * The file is opened by the parent so the child only has to dup2 it onto STDIN.
+*/
+int input_redirection_preparation_handler(const command_t* command, launch_spec_t* spec)
+{
+    int fd = open(command->input_path, (O_RDONLY | O_CLOEXEC), (S_IRUSR | S_IWUSR));
+    if (-1 == fd) {
+        perror("open failed");
+        return GENERAL_FAILURE;
+    }
+
+    // the child reads the file directly, without a pipe or a copying helper in between.
+    // readahead state belongs to the open file, so hinting it here covers the child's reads - best effort.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    spec->stdin_fd = fd;   // closed by the caller after launch.
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Opens the ">" target of the command (command->output_path), or the ">>" target for appending.
+ * The file is opened by the parent so the child only has to dup2 it onto STDOUT.
+ * with O_APPEND every write lands at the end of the file atomically, so concurrent writers need no helper process.
+*/
+int output_redirection_preparation_handler(const command_t* command, launch_spec_t* spec)
+{
+    int flags = command->is_append ? (O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC) : (O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC);
+    int fd = open(command->output_path, flags, (S_IRUSR | S_IWUSR));
+    if (-1 == fd) {
+        perror("open failed");
+        return GENERAL_FAILURE;
+    }
+
+    spec->stdout_fd = fd;  // closed by the caller after launch.
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Opens the "2>" target of the command (command->error_path).
+*/
+int error_redirection_preparation_handler(const command_t* command, launch_spec_t* spec)
+{
+    int fd = open(command->error_path, (O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC), (S_IRUSR | S_IWUSR));
+    if (-1 == fd) {
+        perror("open failed");
+        return GENERAL_FAILURE;
+    }
+
+    spec->stderr_fd = fd;  // closed by the caller after launch.
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Opens the redirections of the command (any of them, or none) into spec->stdin_fd, spec->stdout_fd and spec->stderr_fd.
+ * With "2>&1" on the last stage, spec->stderr_fd is STDOUT_FILENO - the child's STDOUT, redirected or not. With "2>&1"
+ * before the output redirection, it is a copy of output_fd - the STDOUT of the command without it (-1 for the shell's).
+ * Prints the failure and leaves nothing open if any cannot be opened.
+*/
+int prepare_redirections(const command_t* command, int output_fd, launch_spec_t* spec)
+{
+    if ((NULL != command->input_path) && (GENERAL_SUCCESS != input_redirection_preparation_handler(command, spec))) {
+        goto fail;
+    }
+    if ((NULL != command->output_path) && (GENERAL_SUCCESS != output_redirection_preparation_handler(command, spec))) {
+        goto fail;
+    }
+    if ((NULL != command->error_path) && (GENERAL_SUCCESS != error_redirection_preparation_handler(command, spec))) {
+        goto fail;
+    }
+    if (command->stages[command->stage_count - 1].is_error_to_output) {
+        spec->stderr_fd = STDOUT_FILENO;
+    }
+    if (command->is_error_to_original_output) {
+        // a copy, as the child's STDOUT is replaced (by the output redirection) before its STDERR.
+        spec->stderr_fd = fcntl((-1 != output_fd) ? output_fd : STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+        if (-1 == spec->stderr_fd) {
+            perror("fcntl failed");
+            goto fail;
+        }
+    }
+    return GENERAL_SUCCESS;
+
+fail:
+    if (-1 != spec->stdin_fd) {
+        close(spec->stdin_fd);
+        spec->stdin_fd = -1;
+    }
+    if (-1 != spec->stdout_fd) {
+        close(spec->stdout_fd);
+        spec->stdout_fd = -1;
+    }
+    fprintf(stderr, "Error: preparation handler failed.\n");
+    return GENERAL_FAILURE;
+}
+
+int run_true_builtin(int count, char** arglist)
+{
+    return 0;
+}
+
+int run_false_builtin(int count, char** arglist)
+{
+    return 1;
+}
+
+/*
+ * echo [-n] [word...]
+*/
+int run_echo_builtin(int count, char** arglist)
+{
+    bool is_newline = true;
+    int first = 1;
+
+    if ((count > 1) && (0 == strcmp(arglist[1], "-n"))) {
+        is_newline = false;
+        first = 2;
+    }
+
+    for (int i = first; i < count; ++i) {
+        fputs(arglist[i], stdout);
+        if (i + 1 < count) {
+            fputc(' ', stdout);
+        }
+    }
+    if (is_newline) {
+        fputc('\n', stdout);
+    }
+    return 0;
+}
+
+/*
+ * cd [dir] - changes the working directory of the shell (and of every command launched after). defaults to $HOME.
+*/
+int run_cd_builtin(int count, char** arglist)
+{
+    const char* dir = (count > 1) ? arglist[1] : getenv("HOME");
+
+    if (NULL == dir) {
+        fprintf(stderr, "cd: HOME not set\n");
+        return 1;
+    }
+    if (-1 == chdir(dir)) {
+        fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    zygote.is_cwd_stale = true;     // children of the zygote start in its own directory.
+    return 0;
+}
+
+int run_pwd_builtin(int count, char** arglist)
+{
+    char* cwd = getcwd(NULL, 0);
+    if (NULL == cwd) {
+        perror("getcwd failed");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+int run_exit_builtin(int count, char** arglist)
+{
+    is_exit_requested = true;
+    return 0;
+}
+
+static void interrupt_sleep_handler(int signum)
+{
+    // nothing to do - only makes ppoll return with EINTR.
+}
+
+/*
+ * sleep seconds - seconds may be fractional. SIGINT interrupts it, like it terminates a foreground sleep process.
+*/
+int run_sleep_builtin(int count, char** arglist)
+{
+    struct sigaction interrupt_action = {0};
+    struct sigaction previous_action = {0};
+    struct timespec remaining = {0};
+    char* end = NULL;
+    double seconds = 0;
+    int status = 0;
+
+    if (count < 2) {
+        fprintf(stderr, "sleep: missing operand\n");
+        return 1;
+    }
+    seconds = strtod(arglist[1], &end);
+    if ((end == arglist[1]) || ('\0' != *end) || !(seconds >= 0)) {
+        fprintf(stderr, "sleep: invalid time interval '%s'\n", arglist[1]);
+        return 1;
+    }
+    remaining.tv_sec = (time_t)seconds;
+    remaining.tv_nsec = (long)((seconds - (double)remaining.tv_sec) * 1e9);
+
+    // the shell only forwards SIGINT to its children, catch it (without SA_RESTART) for the duration of the sleep.
+    interrupt_action.sa_handler = interrupt_sleep_handler;
+    if (-1 == sigaction(SIGINT, &interrupt_action, &previous_action)) {
+        perror("sigaction failed");
+        return 1;
+    }
+    // SIGINT is blocked outside of waits - unblocked atomically for the sleep, so it cannot slip in right before it.
+    interrupt_discard();
+    if (-1 == ppoll(NULL, 0, &remaining, &wait_sigmask)) {
+        status = (EINTR == errno) ? (128 + SIGINT) : 1;
+    }
+    sigaction(SIGINT, &previous_action, NULL);  // back to forwarding SIGINT - best effort.
+
+    return status;
+}
+
+/*
+ * jobs - lists the background jobs. Finished jobs are listed with their exit status and resource usage, and then removed.
+*/
+int run_jobs_builtin(int count, char** arglist)
+{
+    struct timespec now;
+    job_t* job = jobs.head;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (NULL != job) {
+        job_t* next = job->next;
+        const child_record_t* last = &job->children[job->child_count - 1];
+        pid_t pid = -1;
+        double start = 0;
+        double end = 0;
+        double user = 0;
+        double sys = 0;
+        long maxrss = 0;
+
+        // a pipeline is summed over its stages - from the first launch to the last exit.
+        for (size_t i = 0; i < job->child_count; ++i) {
+            const child_record_t* child = &job->children[i];
+            if (-1 == child->pid) {
+                continue;
+            }
+            if (-1 == pid) {
+                pid = child->pid;
+                start = timespec_to_seconds(&child->start_time);
+            }
+            if (child->is_reaped) {
+                if (timespec_to_seconds(&child->end_time) > end) {
+                    end = timespec_to_seconds(&child->end_time);
+                }
+                user += timeval_to_seconds(&child->usage.ru_utime);
+                sys += timeval_to_seconds(&child->usage.ru_stime);
+                if (child->usage.ru_maxrss > maxrss) {
+                    maxrss = child->usage.ru_maxrss;
+                }
+            }
+        }
+
+        if (!job_is_done(job)) {
+            printf("[%d] %d Running %.3fs %s\n", job->id, pid, timespec_to_seconds(&now) - start, job->command_line);
+        } else {
+            char state[32];
+            char cgroup_usage[64] = "";
+            double cgroup_cpu = 0;
+            long cgroup_memory_peak = -1;
+            if ((-1 != last->cgroup_fd) && (GENERAL_SUCCESS == cgroup_read_usage(last->cgroup_fd, &cgroup_cpu, &cgroup_memory_peak))) {
+                // the cgroup also accounts for what the stages left behind (and did not wait for), unlike rusage.
+                int length = snprintf(cgroup_usage, sizeof(cgroup_usage), "cgroup cpu %.3fs ", cgroup_cpu);
+                if (0 <= cgroup_memory_peak) {
+                    snprintf(cgroup_usage + length, sizeof(cgroup_usage) - length, "memory.peak %ldKB ", cgroup_memory_peak);
+                }
+            }
+            if ((-1 != last->pid) && WIFSIGNALED(last->status)) {
+                snprintf(state, sizeof(state), "Signal %d", WTERMSIG(last->status));
+            } else if (0 == job_exit_status(job)) {
+                snprintf(state, sizeof(state), "Done");
+            } else {
+                snprintf(state, sizeof(state), "Exit %d", job_exit_status(job));
+            }
+            printf("[%d] %d %s real %.3fs user %.3fs sys %.3fs maxrss %ldKB %s%s\n", job->id, pid, state,
+                   end - start, user, sys, maxrss, cgroup_usage, job->command_line);
+            job_remove(job);    // reported once.
+        }
+        job = next;
+    }
+    return 0;
+}
+
+/*
+ * Waits for a background job to complete, or for SIGINT - which the job ignores, so it only stops the wait.
+ * returns GENERAL_FAILURE on a shell failure, and sets is_interrupted if stopped by SIGINT.
+*/
+static int wait_job(job_t* job, bool* is_interrupted)
+{
+    unsigned long first_interrupt = 0;
+
+    interrupt_discard();
+    first_interrupt = interrupt_count;
+
+    while (!job_is_done(job)) {
+        if (first_interrupt != interrupt_count) {
+            *is_interrupted = true;
+            return GENERAL_SUCCESS;
+        }
+        if (GENERAL_SUCCESS != reaper_poll(-1)) {
+            return GENERAL_FAILURE;
+        }
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * wait [id...] - waits for the given background jobs, or for all of them. Finished jobs stay listed by jobs.
+ * returns the exit status of the last job waited for, 130 if SIGINT stopped the wait.
+*/
+int run_wait_builtin(int count, char** arglist)
+{
+    bool is_interrupted = false;
+    int status = 0;
+
+    if (1 == count) {
+        for (job_t* job = jobs.head; NULL != job; job = job->next) {
+            if (GENERAL_SUCCESS != wait_job(job, &is_interrupted)) {
+                return 1;
+            }
+            if (is_interrupted) {
+                return 128 + SIGINT;
+            }
+            status = job_exit_status(job);
+        }
+        return status;
+    }
+
+    for (int i = 1; i < count; ++i) {
+        job_t* job = job_find(arglist[i]);
+        if (NULL == job) {
+            fprintf(stderr, "wait: %s: no such job\n", arglist[i]);
+            status = 127;
+            continue;
+        }
+        if (GENERAL_SUCCESS != wait_job(job, &is_interrupted)) {
+            return 1;
+        }
+        if (is_interrupted) {
+            return 128 + SIGINT;
+        }
+        status = job_exit_status(job);
+    }
+    return status;
+}
+
+/*
+ * fg [id] - waits in the foreground for a background job (the most recent one by default), which then leaves the job table.
+ * the job keeps ignoring SIGINT, as it was launched in the background - SIGINT stops the wait, and the job stays.
+*/
+int run_fg_builtin(int count, char** arglist)
+{
+    job_t* job = job_find((count > 1) ? arglist[1] : NULL);
+    bool is_interrupted = false;
+    int status = 0;
+
+    if (NULL == job) {
+        fprintf(stderr, "fg: %s: no such job\n", (count > 1) ? arglist[1] : "current");
+        return 1;
+    }
+
+    printf("%s\n", job->command_line);
+    fflush(stdout);
+    if (GENERAL_SUCCESS != wait_job(job, &is_interrupted)) {
+        return 1;
+    }
+    if (is_interrupted) {
+        return 128 + SIGINT;
+    }
+    status = job_exit_status(job);
+    job_remove(job);
+    return status;
+}
+
+// a signal by name (with or without "SIG") or number. returns -1 for an unknown signal.
+static int parse_signal(const char* text)
+{
+    char* end = NULL;
+    long number = strtol(text, &end, 10);
+
+    if ((end != text) && ('\0' == *end)) {
+        return ((0 <= number) && (number < NSIG)) ? (int)number : -1;
+    }
+    if (0 == strncmp(text, "SIG", 3)) {
+        text += 3;
+    }
+    for (int signum = 1; signum < NSIG; ++signum) {
+        const char* name = sigabbrev_np(signum);
+        if ((NULL != name) && (0 == strcmp(name, text))) {
+            return signum;
+        }
+    }
+    return -1;
+}
+
+/*
+ * kill [-signal] %id|pid... - sends the signal (SIGTERM by default) to background jobs or to processes.
+ * every job is a process group, so a single killpg reaches all the stages of its pipeline.
+*/
+int run_kill_builtin(int count, char** arglist)
+{
+    int signum = SIGTERM;
+    int first = 1;
+    int status = 0;
+
+    if ((count > 1) && ('-' == arglist[1][0])) {
+        signum = parse_signal(arglist[1] + 1);
+        if (-1 == signum) {
+            fprintf(stderr, "kill: %s: invalid signal specification\n", arglist[1] + 1);
+            return 1;
+        }
+        first = 2;
+    }
+    if (first == count) {
+        fprintf(stderr, "kill: usage: kill [-signal] %%id | pid...\n");
+        return SYNTAX_ERROR_STATUS;
+    }
+
+    for (int i = first; i < count; ++i) {
+        if ('%' == arglist[i][0]) {
+            job_t* job = job_find(arglist[i]);
+            if ((NULL == job) || (0 == job_pgid(job))) {
+                fprintf(stderr, "kill: %s: no such job\n", arglist[i]);
+                status = 1;
+            } else if (!job_is_done(job) && (-1 == killpg(job_pgid(job), signum))) {
+                // a finished job is not signaled - its process group id may belong to someone else by now.
+                fprintf(stderr, "kill: %s: %s\n", arglist[i], strerror(errno));
+                status = 1;
+            }
+            continue;
+        }
+
+        char* end = NULL;
+        long pid = strtol(arglist[i], &end, 10);
+        if ((end == arglist[i]) || ('\0' != *end)) {
+            fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", arglist[i]);
+            status = 1;
+        } else if (-1 == kill((pid_t)pid, signum)) {
+            fprintf(stderr, "kill: (%ld): %s\n", pid, strerror(errno));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/*
+ * set [-o | +o pipefail] - turns pipefail on (-o) or off (+o). set -o alone lists the options.
+*/
+int run_set_builtin(int count, char** arglist)
+{
+    if ((2 == count) && (0 == strcmp(arglist[1], "-o"))) {
+        printf("pipefail %s\n", is_pipefail ? "on" : "off");
+        return 0;
+    }
+    if ((3 != count) || (0 != strcmp(arglist[2], "pipefail")) ||
+        ((0 != strcmp(arglist[1], "-o")) && (0 != strcmp(arglist[1], "+o")))) {
+        fprintf(stderr, "set: usage: set [-o | +o pipefail]\n");
+        return SYNTAX_ERROR_STATUS;
+    }
+    is_pipefail = ('-' == arglist[1][0]);
+    return 0;
+}
+
+// consulted before launching a command. these run inside the shell process, without fork or exec.
+static const builtin_t builtins[] = {
+    { "true", run_true_builtin, true },
+    { "false", run_false_builtin, true },
+    { "echo", run_echo_builtin, true },
+    { "cd", run_cd_builtin, false },
+    { "pwd", run_pwd_builtin, true },
+    { "exit", run_exit_builtin, false },
+    { "sleep", run_sleep_builtin, true },
+    { "hash", run_hash_builtin, false },
+    { "pipesize", run_pipesize_builtin, false },
+    { "cpupolicy", run_cpupolicy_builtin, false },
+    { "jobs", run_jobs_builtin, false },
+    { "wait", run_wait_builtin, false },
+    { "fg", run_fg_builtin, false },
+    { "set", run_set_builtin, false },
+    { "kill", run_kill_builtin, false },
+};
+
+const builtin_t* find_builtin(const char* name)
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+        if (0 == strcmp(builtins[i].name, name)) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Points target_fd to fd for the duration of a builtin. The original is saved in *saved_fd.
+*/
+static int redirect_shell_fd(int fd, int target_fd, int* saved_fd)
+{
+    *saved_fd = fcntl(target_fd, F_DUPFD_CLOEXEC, 3);
+    if (-1 == *saved_fd) {
+        perror("fcntl failed");
+        return GENERAL_FAILURE;
+    }
+    if (-1 == dup2(fd, target_fd)) {
+        perror("dup2 failed");
+        close(*saved_fd);
+        *saved_fd = -1;
+        return GENERAL_FAILURE;
+    }
+    return GENERAL_SUCCESS;
+}
+
+static int restore_shell_fd(int target_fd, int saved_fd)
+{
+    int return_code = GENERAL_SUCCESS;
+    if (-1 == dup2(saved_fd, target_fd)) {
+        perror("dup2 failed");
+        return_code = GENERAL_FAILURE;
+    }
+    close(saved_fd);
+    return return_code;
+}
+
+/*
+ * Runs a builtin in the shell process. Redirections are honored by temporarily pointing the shell's own STDIN / STDOUT /
+ * STDERR to the file, so they behave just like for a launched command.
+ * returns GENERAL_FAILURE only if the shell's STDIN / STDOUT / STDERR could not be restored (or saved).
+*/
+int run_builtin_command(const command_t* command, const builtin_t* builtin)
+{
+    int return_code = GENERAL_FAILURE;
+    const pipeline_stage_t* stage = &command->stages[0];
+    launch_spec_t spec = { .argv = stage->argv, .stdin_fd = -1, .stdout_fd = -1, .stderr_fd = -1 };
+    int saved_stdin = -1;
+    int saved_stdout = -1;
+    int saved_stderr = -1;
+
+    if (GENERAL_SUCCESS != prepare_redirections(command, -1, &spec)) {
+        // drop the command and continue to the next one.
+        last_status = 1;
+        return_code = GENERAL_SUCCESS;  // not considered a shell (parent process) failure.
+        goto cleanup;
+    }
+
+    fflush(stdout); // anything the shell printed so far belongs to the original STDOUT.
+    if ((-1 != spec.stdin_fd) && (GENERAL_SUCCESS != redirect_shell_fd(spec.stdin_fd, STDIN_FILENO, &saved_stdin))) {
+        goto cleanup;
+    }
+    if ((-1 != spec.stdout_fd) && (GENERAL_SUCCESS != redirect_shell_fd(spec.stdout_fd, STDOUT_FILENO, &saved_stdout))) {
+        goto cleanup;
+    }
+    // after STDOUT, so that "2>&1" follows its redirection.
+    if ((-1 != spec.stderr_fd) && (GENERAL_SUCCESS != redirect_shell_fd(spec.stderr_fd, STDERR_FILENO, &saved_stderr))) {
+        goto cleanup;
+    }
+
+    last_status = builtin->handler(stage->argc, stage->argv);   // builtins print and handle their own errors.
+    fflush(stdout);
+
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    if ((-1 != saved_stdin) && (GENERAL_SUCCESS != restore_shell_fd(STDIN_FILENO, saved_stdin))) {
+        return_code = GENERAL_FAILURE;
+    }
+    if ((-1 != saved_stdout) && (GENERAL_SUCCESS != restore_shell_fd(STDOUT_FILENO, saved_stdout))) {
+        return_code = GENERAL_FAILURE;
+    }
+    if ((-1 != saved_stderr) && (GENERAL_SUCCESS != restore_shell_fd(STDERR_FILENO, saved_stderr))) {
+        return_code = GENERAL_FAILURE;
+    }
+    if (-1 != spec.stdin_fd) {
+        close(spec.stdin_fd);
+    }
+    if (-1 != spec.stdout_fd) {
+        close(spec.stdout_fd);
+    }
+    if ((-1 != spec.stderr_fd) && (STDOUT_FILENO != spec.stderr_fd)) {
+        close(spec.stderr_fd);
+    }
+    return return_code;
+}
+
+/*
+ * Runs in the child, on launch_stack and in the parent's address space (the parent is suspended meanwhile).
+ * Only async-signal-safe calls are allowed here, and nothing may be written to memory other than spec.
+ * on errors, the child process calls _exit. this does not cause the shell (parent process) to exit, only the child process.
+*/
+static int launch_child(void* arg)
+{
+    launch_spec_t* spec = (launch_spec_t*)arg;
+
+    // without clone3, the child moves itself into the cgroup of its pipeline - still before the command gets to run.
+    if (-1 != spec->cgroup_fd) {
+        int procs_fd = openat(spec->cgroup_fd, "cgroup.procs", (O_WRONLY | O_CLOEXEC));
+        if ((-1 == procs_fd) || (1 != write(procs_fd, "0", 1))) {  // "0" is the writing process itself.
+            spec->failed_call = "cgroup placement failed";
+            goto fail;
+        }
+        close(procs_fd);
+    }
+
+    if ((NULL != spec->affinity) && (-1 == sched_setaffinity(0, sizeof(cpu_set_t), spec->affinity))) {
+        spec->failed_call = "sched_setaffinity failed";
+        goto fail;
+    }
+
+    // every pipeline is a process group of its own, so that a single killpg reaches all of its stages.
+    if (-1 == setpgid(0, spec->pgid)) {
+        spec->failed_call = "setpgid failed";
+        goto fail;
+    }
+    // while STDIN is still the shell's. SIGTTOU is blocked, so a process group that is not in the foreground may do it.
+    if (spec->is_terminal_owner && (-1 == tcsetpgrp(STDIN_FILENO, getpgid(0)))) {
+        spec->failed_call = "tcsetpgrp failed";
+        goto fail;
+    }
+
+    // signal dispositions are not shared with the parent (no CLONE_SIGHAND), and all signals are blocked until execve.
+    // Foreground child processes should terminate upon SIGINT, background ones should not.
+    if (SIG_ERR == signal(SIGINT, spec->is_foreground ? SIG_DFL : SIG_IGN)) {
+        spec->failed_call = "signal failed";
+        goto fail;
+    }
+    if (terminal.is_interactive) {
+        // the shell ignores SIGTTOU (to take the terminal back), and has no job control for stopped pipelines.
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGTSTP, SIG_IGN);
+    }
+
+    if ((-1 != spec->stdin_fd) && (-1 == dup2(spec->stdin_fd, STDIN_FILENO))) {
+        spec->failed_call = "dup2 failed";
+        goto fail;
+    }
+
+    if ((-1 != spec->stdout_fd) && (-1 == dup2(spec->stdout_fd, STDOUT_FILENO))) {
+        spec->failed_call = "dup2 failed";
+        goto fail;
+    }
+
+    if ((-1 != spec->stderr_fd) && (-1 == dup2(spec->stderr_fd, STDERR_FILENO))) {
+        spec->failed_call = "dup2 failed";
+        goto fail;
+    }
+
+    // the command gets STDIN, STDOUT and STDERR only - the originals after dup, and any fd the shell itself inherited
+    // or has not closed yet, would keep pipes open and delay their EOF. best effort.
+    close_range(3, ~0U, 0);
+
+    if (-1 == sigprocmask(SIG_SETMASK, &spec->child_sigmask, NULL)) {
+        spec->failed_call = "sigprocmask failed";
+        goto fail;
+    }
+
+    execve(spec->path, spec->argv, environ);   // should not return from here unless error.
+    if ((ENOEXEC == errno) && (NULL != spec->script_argv)) {
+        // not a binary and no #! line - run it as a shell script, just like execvp.
+        // the argv is not built on the launch stack - a long one would overflow it into the shell's memory.
+        char** script_argv = spec->script_argv;
+        script_argv[0] = "/bin/sh";
+        script_argv[1] = (char*)spec->path;
+        for (int i = 1; NULL != spec->argv[i - 1]; ++i) {
+            script_argv[i + 1] = spec->argv[i];
+        }
+        execve(script_argv[0], script_argv, environ);
+    }
+    spec->failed_call = "execve failed";
+fail:
+    spec->child_errno = errno;
+    _exit(1);
+}
+
+/*
+ * Creates the child of spec right inside its cgroup (clone3 with CLONE_INTO_CGROUP), so that it is limited and accounted
+ * there from its very start. clone3 gives a child that shares the memory no stack of its own to return on, so this one
+ * runs on a copy (still suspended until execve), and reports a failure through cgroups.shared_spec.
+ * returns the pid of the child, or -1 (errno set).
+*/
+static pid_t clone_into_cgroup(launch_spec_t* spec, int extra_flags)
+{
+    struct clone_args args = {
+        .flags = (CLONE_VFORK | CLONE_INTO_CGROUP | extra_flags),
+        .exit_signal = SIGCHLD,
+        .cgroup = (uint64_t)spec->cgroup_fd,
+    };
+    launch_spec_t* shared = cgroups.shared_spec;
+    pid_t pid = -1;
+
+    *shared = *spec;
+    shared->cgroup_fd = -1;     // placed by the kernel.
+    pid = (pid_t)syscall(SYS_clone3, &args, sizeof(args));
+    if (0 == pid) {
+        launch_child(shared);   // does not return.
+    }
+    spec->failed_call = shared->failed_call;
+    spec->child_errno = shared->child_errno;
+    return pid;
+}
+
+/*
+ * Creates the child process of spec (already resolved), sharing memory with the caller until it calls execve.
+ * Used by the shell, and by the zygote (with CLONE_PARENT, so that the child is the shell's).
+ * returns the pid of the child, or -1 (errno set).
+*/
+static pid_t clone_child(launch_spec_t* spec, int extra_flags)
+{
+    // argv of the ENOEXEC fallback (see launch_child). grows to the longest argv seen, reused from launch to launch.
+    static char** script_argv = NULL;
+    static size_t script_argv_capacity = 0;
+    sigset_t all_signals;
+    int clone_errno = 0;
+    pid_t pid = -1;
+    size_t argc = 0;
+
+    while (NULL != spec->argv[argc]) {
+        argc++;
+    }
+    if (argc + 2 > script_argv_capacity) {
+        char** new_script_argv = (char**)realloc(script_argv, (argc + 2) * sizeof(char*));
+        if (NULL != new_script_argv) {
+            script_argv = new_script_argv;
+            script_argv_capacity = argc + 2;
+        }
+    }
+    // without room, a script with no #! line fails like any other command that cannot be executed.
+    spec->script_argv = (argc + 2 <= script_argv_capacity) ? script_argv : NULL;
+
+    // block every signal so that no handler of the shell runs on the child's stack while they share memory.
+    sigfillset(&all_signals);
+    if (-1 == sigprocmask(SIG_BLOCK, &all_signals, &spec->child_sigmask)) {
+        return -1;
+    }
+    sigdelset(&spec->child_sigmask, SIGCHLD);  // blocked in the shell only for the reaper's signalfd.
+    sigdelset(&spec->child_sigmask, SIGINT);   // blocked in the shell only outside its waits.
+
+    spec->failed_call = NULL;
+    spec->child_errno = 0;
+    if ((-1 != spec->cgroup_fd) && cgroups.has_clone_into_cgroup) {
+        pid = clone_into_cgroup(spec, extra_flags);
+        if ((-1 == pid) && ((ENOSYS == errno) || (E2BIG == errno) || (EINVAL == errno))) {
+            cgroups.has_clone_into_cgroup = false;  // an older kernel - the children move themselves from now on.
+        }
+    }
+    if (-1 == pid) {
+        // any other failure of clone3 shows up again in the child, as a command that fails (rather than the shell).
+        pid = clone(launch_child, launch_stack + sizeof(launch_stack), (CLONE_VM | CLONE_VFORK | SIGCHLD | extra_flags), spec);
+    }
+    clone_errno = errno;
+
+    sigaddset(&spec->child_sigmask, SIGCHLD);
+    sigaddset(&spec->child_sigmask, SIGINT);
+    sigprocmask(SIG_SETMASK, &spec->child_sigmask, NULL);  // restore the signal mask - best effort.
+
+    errno = clone_errno;
+    return pid;
+}
+
+/*
+ * The zygote - serves launch requests until the shell closes its end of the socket.
+ * It is forked while the shell is small, and holds nothing but the launch stack and this socket.
+*/
+static void zygote_main(int socket_fd)
+{
+    static char request_buffer[ZYGOTE_REQUEST_SIZE];
+
+    for (;;) {
+        char control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+        struct iovec iov = { .iov_base = request_buffer, .iov_len = sizeof(request_buffer) };
+        struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+        zygote_request_t request;
+        zygote_reply_t reply = { .pid = -1 };
+        int fds[ZYGOTE_MAX_FDS] = { -1, -1, -1, -1 };
+        int fd_count = 0;
+        int next_fd = 0;
+        ssize_t length = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC);
+
+        if ((-1 == length) && (EINTR == errno)) {
+            continue;
+        }
+        if (0 >= length) {
+            _exit(0);   // the shell is gone.
+        }
+
+        struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+        if ((NULL != header) && (SOL_SOCKET == header->cmsg_level) && (SCM_RIGHTS == header->cmsg_type)) {
+            fd_count = (int)((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds, CMSG_DATA(header), fd_count * sizeof(int));
+        }
+        memcpy(&request, request_buffer, sizeof(request));
+
+        char* word = request_buffer + sizeof(request);
+        char* argv[request.argc + 1];
+        launch_spec_t spec = { .path = word, .argv = argv, .stdin_fd = -1, .stdout_fd = -1, .stderr_fd = -1, .cgroup_fd = -1,
+                               .is_foreground = request.is_foreground, .pgid = request.pgid,
+                               .is_terminal_owner = request.is_terminal_owner,
+                               .affinity = request.has_affinity ? &request.affinity : NULL };
+        for (int i = 0; i < request.argc; ++i) {
+            word += strlen(word) + 1;
+            argv[i] = word;
+        }
+        argv[request.argc] = NULL;
+
+        if (request.has_cwd) {
+            fchdir(fds[next_fd++]);     // best effort - just like a child whose cwd was removed.
+        }
+        if (request.has_stdin) {
+            spec.stdin_fd = fds[next_fd++];
+        }
+        if (request.has_stdout) {
+            spec.stdout_fd = fds[next_fd++];
+        }
+        if (request.has_stderr) {
+            spec.stderr_fd = fds[next_fd++];
+        }
+        if (request.is_error_to_output) {
+            spec.stderr_fd = STDOUT_FILENO;
+        }
+
+        reply.pid = clone_child(&spec, CLONE_PARENT);
+        reply.clone_errno = errno;
+        reply.child_errno = spec.child_errno;
+        if (NULL != spec.failed_call) {
+            snprintf(reply.failed_call, sizeof(reply.failed_call), "%s", spec.failed_call);
+        }
+        for (int i = 0; i < fd_count; ++i) {
+            close(fds[i]);
+        }
+        if (-1 == send(socket_fd, &reply, sizeof(reply), MSG_NOSIGNAL)) {
+            _exit(1);
+        }
+    }
+}
+
+/*
+ * Forks the zygote - a small helper process that creates the shell's children on request (MYSHELL_ZYGOTE=1).
+ * Its children are created with CLONE_PARENT, so the shell reaps them as usual.
+ * Best effort - the shell launches children itself if the zygote cannot be started.
+*/
+static void zygote_start(void)
+{
+    int sockets[2] = { -1, -1 };
+
+    if (-1 == socketpair(AF_UNIX, (SOCK_SEQPACKET | SOCK_CLOEXEC), 0, sockets)) {
+        perror("socketpair failed");
+        return;
+    }
+
+    fflush(stdout); // the zygote must not inherit pending output.
+    zygote.pid = fork();
+    if (-1 == zygote.pid) {
+        perror("fork failed");
+        close(sockets[0]);
+        close(sockets[1]);
+        return;
+    }
+
+    if (0 == zygote.pid) {
+        prctl(PR_SET_PDEATHSIG, SIGKILL);   // never outlive the shell.
+        // keep only the standard streams (inherited by the children) and the zygote's end of the socket.
+        close(sockets[0]);
+        if (3 < sockets[1]) {
+            close_range(3, sockets[1] - 1, 0);
+        }
+        close_range(sockets[1] + 1, ~0U, 0);
+        zygote_main(sockets[1]);
+    }
+
+    close(sockets[1]);
+    zygote.socket_fd = sockets[0];
+}
+
+static void zygote_stop(void)
+{
+    if (-1 == zygote.socket_fd) {
+        return;
+    }
+    close(zygote.socket_fd);    // the zygote exits when it reads EOF.
+    zygote.socket_fd = -1;
+    waitpid(zygote.pid, NULL, 0);   // ECHILD if the reaper's signalfd reaped it already.
+    zygote.pid = -1;
+}
+
+/*
+ * Same as clone_child, through the zygote. Falls back to clone_child if the request does not fit in a message, and
+ * stops using the zygote if it does not respond.
+*/
+static pid_t zygote_clone(launch_spec_t* spec)
+{
+    static char request_buffer[ZYGOTE_REQUEST_SIZE];
+    char control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))] = {0};
+    zygote_request_t request = { .is_foreground = spec->is_foreground, .pgid = spec->pgid,
+                                 .is_terminal_owner = spec->is_terminal_owner, .has_affinity = (NULL != spec->affinity) };
+    zygote_reply_t reply;
+    int fds[ZYGOTE_MAX_FDS];
+    int fd_count = 0;
+    size_t length = sizeof(request);
+    char* end = request_buffer + sizeof(request);
+
+    if (NULL != spec->affinity) {
+        request.affinity = *spec->affinity;
+    }
+
+    for (const char* const* word = (const char* const*)spec->argv; NULL != *word; ++word) {
+        length += strlen(*word) + 1;
+        request.argc++;
+    }
+    length += strlen(spec->path) + 1;
+    if (length > sizeof(request_buffer)) {
+        return clone_child(spec, 0);
+    }
+
+    if (zygote.is_cwd_stale) {
+        fds[fd_count] = open(".", (O_PATH | O_DIRECTORY | O_CLOEXEC));
+        if (-1 == fds[fd_count]) {
+            return clone_child(spec, 0);
+        }
+        request.has_cwd = true;
+        fd_count++;
+    }
+    if (-1 != spec->stdin_fd) {
+        fds[fd_count++] = spec->stdin_fd;
+        request.has_stdin = true;
+    }
+    if (-1 != spec->stdout_fd) {
+        fds[fd_count++] = spec->stdout_fd;
+        request.has_stdout = true;
+    }
+    if (STDOUT_FILENO == spec->stderr_fd) {
+        request.is_error_to_output = true;
+    } else if (-1 != spec->stderr_fd) {
+        fds[fd_count++] = spec->stderr_fd;
+        request.has_stderr = true;
+    }
+
+    memcpy(request_buffer, &request, sizeof(request));
+    end = stpcpy(end, spec->path) + 1;
+    for (int i = 0; i < request.argc; ++i) {
+        end = stpcpy(end, spec->argv[i]) + 1;
+    }
+
+    struct iovec iov = { .iov_base = request_buffer, .iov_len = length };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (0 < fd_count) {
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(header), fds, fd_count * sizeof(int));
+    }
+
+    bool is_sent = (-1 != sendmsg(zygote.socket_fd, &message, MSG_NOSIGNAL));
+    if (request.has_cwd) {
+        close(fds[0]);
+    }
+    ssize_t reply_length = -1;
+    if (is_sent) {
+        do {
+            reply_length = recv(zygote.socket_fd, &reply, sizeof(reply), 0);
+        } while ((-1 == reply_length) && (EINTR == errno));
+    }
+    if (sizeof(reply) != reply_length) {
+        perror("zygote failed");
+        zygote_stop();
+        return clone_child(spec, 0);
+    }
+
+    if (request.has_cwd) {
+        zygote.is_cwd_stale = false;
+    }
+    spec->child_errno = reply.child_errno;
+    spec->failed_call = NULL;
+    if ('\0' != reply.failed_call[0]) {
+        memcpy(zygote.failed_call, reply.failed_call, sizeof(zygote.failed_call));
+        spec->failed_call = zygote.failed_call;
+    }
+    errno = reply.clone_errno;
+    return reply.pid;
+}
+
+/*
+ * Launches spec->argv in a new child process without copying the shell's page tables (unlike fork).
+ * The executable is resolved here, through the command path cache.
+ * Errors of the child before execve are printed here, in which case the child has already exited and should still be waited for.
+ * *pid is set to the pid of the child, or -1 if the command was dropped (not found).
+ * returns GENERAL_FAILURE if no child could be created.
+*/
+int launch_command(launch_spec_t* spec, pid_t* pid)
+{
+    *pid = -1;
+
+    spec->path = resolve_command_path(spec->argv[0]);
+    if (NULL == spec->path) {
+        if (ENOENT != errno) {
+            perror("command lookup failed");
+            return GENERAL_FAILURE;
+        }
+        // drop the command, just like a child whose execvp failed.
+        fprintf(stderr, "%s: command not found\n", spec->argv[0]);
+        return GENERAL_SUCCESS;
+    }
+
+    // the zygote does not get the cgroup of the pipeline - such children are launched by the shell.
+    *pid = ((-1 != zygote.socket_fd) && (-1 == spec->cgroup_fd)) ? zygote_clone(spec) : clone_child(spec, 0);
+    if (-1 == *pid) {
+        perror("clone failed");
+        return GENERAL_FAILURE;
+    }
+
+    if (NULL != spec->failed_call) {
+        errno = spec->child_errno;
+        perror(spec->failed_call);
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Launches every stage of the command line, wired with pipes. A simple command is a pipeline of one stage.
+ * stdio_fds (NULL to inherit all three) replace the shell's STDIN, STDOUT and STDERR for the command line, -1 to inherit one.
+ * The input redirection (if any) feeds the first stage, and the output (and error) redirections apply to the last one.
+ * children[i] is the record of stage i, watched by the reaper once launched (pid -1 otherwise).
+ * The stages are a process group of their own, led by the first stage that is launched. With is_terminal_owner (an
+ * interactive shell only) it becomes the foreground process group of the terminal, until the shell takes it back.
+ * A background pipeline (in an interactive shell, any that does not own the terminal) reads /dev/null, unless given a STDIN.
+ * The command line is dropped (all pids -1) if a redirection cannot be opened.
+ * returns GENERAL_FAILURE on a shell (parent process) failure, with nothing left registered and the launched stages killed.
+*/
+int launch_pipeline(const command_t* command, child_record_t* children, bool is_foreground, bool is_terminal_owner,
+                    const int* stdio_fds)
 {
-    // wait for any child process to prevent zombies - best effort.
-    while (waitpid(-1, NULL, WNOHANG) > 0) {}
+    int return_code = GENERAL_FAILURE;
+    pid_t pgid = 0;     // process group of the pipeline, 0 until its first stage is launched.
+    cpu_set_t affinity;     // of all the stages, if placed by the CPU policy.
+    bool has_affinity = next_pipeline_affinity(&affinity);
+    int pipe_from_prev = -1;    // read end of the previous pipe, inherited by the current child.
+    int pipe_to_next[2] = { -1, -1 };
+    struct timespec launch_time;    // of the current stage, see reaper_watch.
+    launch_spec_t redirections = { .stdin_fd = -1, .stdout_fd = -1, .stderr_fd = -1 };
+    const int inherited_fds[3] = { -1, -1, -1 };
+    const pipeline_stage_t* stages = command->stages;
+    size_t stage_count = command->stage_count;
+
+    if (NULL == stdio_fds) {
+        stdio_fds = inherited_fds;
+    }
+    // only a SIGINT that arrives from now on is forwarded to the pipeline.
+    interrupt_discard();
+
+    for (size_t i = 0; i < stage_count; i++) {
+        children[i].pid = -1;
+        children[i].pidfd = -1;
+        children[i].pgid = 0;
+        children[i].cgroup_fd = -1;
+        children[i].status = W_EXITCODE(127, 0);    // command not found, unless launched.
+    }
+
+    // call handlers for preprocessing (for redirections), and give the pipeline a cgroup leaf of its own if configured.
+    if ((GENERAL_SUCCESS != prepare_redirections(command, stdio_fds[STDOUT_FILENO], &redirections)) ||
+        ((-1 != cgroups.parent_fd) && (GENERAL_SUCCESS != cgroup_create(&children[stage_count - 1])))) {
+        // drop the command line and continue to the next one.
+        for (size_t i = 0; i < stage_count; i++) {
+            children[i].status = W_EXITCODE(1, 0);
+        }
+        return_code = GENERAL_SUCCESS;  // not considered a shell (parent process) failure.
+        goto cleanup;
+    }
+    // the shell has no job control - a pipeline outside the terminal's foreground process group would be stopped
+    // (SIGTTIN) for good if it read the terminal. like "&" in POSIX shells, such pipelines read /dev/null instead.
+    if ((-1 == redirections.stdin_fd) && (-1 == stdio_fds[STDIN_FILENO]) &&
+        (!is_foreground || (terminal.is_interactive && !is_terminal_owner))) {
+        redirections.stdin_fd = open("/dev/null", (O_RDONLY | O_CLOEXEC));
+        if (-1 == redirections.stdin_fd) {
+            perror("open failed");
+            goto cleanup;
+        }
+    }
+
+    // wire - run commands concurrently in a pipeline
+    for (size_t i = 0; i < stage_count; i++) {
+        bool is_last = (i + 1 == stage_count);
+        // for each command pair in the pipeline
+        // close-on-exec - every child holds only the pipe ends it dup2'd onto STDIN and STDOUT.
+        if (!is_last && (-1 == pipe2(pipe_to_next, O_CLOEXEC))) {
+            perror("pipe2 failed");
+            goto cleanup;
+        }
+        if (!is_last && (0 != pipe_buffer_size)) {
+            // larger pipes let bursty producers run ahead of their consumers without a context switch - best effort.
+            fcntl(pipe_to_next[1], F_SETPIPE_SZ, (int)pipe_buffer_size);
+        }
+
+        launch_spec_t spec = {
+            .argv = stages[i].argv,
+            .stdin_fd = pipe_from_prev,     // not the first command - stdin is the read end of the previous pipe
+            .stdout_fd = pipe_to_next[1],   // not the last command - stdout is the write end of the next pipe
+            .stderr_fd = stages[i].is_error_to_output ? STDOUT_FILENO : stdio_fds[STDERR_FILENO],   // "2>&1" - the pipe.
+            .is_foreground = is_foreground, // Foreground child processes should terminate upon SIGINT.
+            .pgid = pgid,
+            .is_terminal_owner = is_terminal_owner && (0 == pgid),  // done by the group leader.
+            .cgroup_fd = children[stage_count - 1].cgroup_fd,
+            .affinity = has_affinity ? &affinity : NULL,
+        };
+        // (writing end of pipe from prev is expected to be closed by the parent before launch)
+        if (0 == i) {
+            spec.stdin_fd = (-1 != redirections.stdin_fd) ? redirections.stdin_fd : stdio_fds[STDIN_FILENO];
+        }
+        if (is_last) {
+            spec.stdout_fd = (-1 != redirections.stdout_fd) ? redirections.stdout_fd : stdio_fds[STDOUT_FILENO];
+            if (-1 != redirections.stderr_fd) {
+                spec.stderr_fd = redirections.stderr_fd;
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &launch_time);
+        if (GENERAL_SUCCESS != launch_command(&spec, &children[i].pid)) {
+            goto cleanup;
+        }
+        if ((-1 != children[i].pid) && (0 == pgid)) {
+            pgid = children[i].pid;
+        }
+        children[i].pgid = pgid;
+        children[i].is_foreground = is_foreground;
+        if ((-1 != children[i].pid) && (GENERAL_SUCCESS != reaper_watch(&children[i], &launch_time, stages[i].argv[0], (int)i))) {
+            goto cleanup;
+        }
+
+        // close pipe ends in parent. mark as closed.
+        if (-1 != pipe_from_prev) {
+            close(pipe_from_prev);
+            pipe_from_prev = -1;
+        }
+
+        // close writing end of the next pipe, it belongs to the child.
+        if (-1 != pipe_to_next[1]) {
+            close(pipe_to_next[1]);
+            pipe_to_next[1] = -1;
+        }
+
+        // move up the pipeline. reading end inherited by the next child process.
+        pipe_from_prev = pipe_to_next[0];
+        pipe_to_next[0] = -1;
+    }
+
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    if (GENERAL_SUCCESS != return_code) {
+        if (0 != pgid) {
+            killpg(pgid, SIGKILL);  // no straggler of a half-launched pipeline is left running - best effort.
+        }
+        for (size_t i = 0; i < stage_count; ++i) {
+            reaper_forget(&children[i]);    // nothing is left registered on failure.
+        }
+        cgroup_release(&children[stage_count - 1]);
+    }
+    if (-1 != pipe_from_prev) {
+        close(pipe_from_prev);
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (-1 != pipe_to_next[i]) {
+            close(pipe_to_next[i]);
+        }
+    }
+    // the redirection files are only needed by the children, which have their own copies after launch.
+    if (-1 != redirections.stdin_fd) {
+        close(redirections.stdin_fd);
+    }
+    if ((-1 != redirections.stderr_fd) && (STDOUT_FILENO != redirections.stderr_fd)) {
+        close(redirections.stderr_fd);
+    }
+    if (-1 != redirections.stdout_fd) {
+        close(redirections.stdout_fd);
+    }
+    return return_code;
 }
 
-bool is_piping_command(int count, char** arglist)
+/*
+ * Runs a command line - waits for all of its children in the foreground, or adds it to the job table in the background.
+*/
+int run_command(const command_t* command, bool is_foreground)
 {
-    // If a command line contains the | symbol, then it may appear multiple times. detect one such appearance.
-    for (int i = 0; i < count; ++i) {
-        if (strcmp(arglist[i], "|") == 0) {
+    int return_code = GENERAL_FAILURE;
+    child_record_t* children = command->children;
+    job_t* job = NULL;
+
+    if (!is_foreground) {
+        // a background command line is tracked in the job table until its completion is reported.
+        job = job_create(command);
+        if (NULL == job) {
+            perror("malloc failed");
+            goto cleanup;
+        }
+        children = job->children;
+    }
+
+    if (GENERAL_SUCCESS != launch_pipeline(command, children, is_foreground, is_foreground && terminal.is_interactive, NULL)) {
+        goto cleanup;
+    }
+
+    if (!is_foreground) {
+        if (job_is_launched(job)) {
+            job_add(job);
+            job = NULL;     // owned by the job table now.
+        }
+        last_status = 0;
+        reaper_poll(0); // reap any zombie processes that are already done - best effort.
+    } else {
+        int wait_result = wait_children(children, command->stage_count);
+        if (terminal.is_interactive) {
+            tcsetpgrp(STDIN_FILENO, terminal.shell_pgid);  // take the terminal back - best effort.
+        }
+        if (GENERAL_SUCCESS != wait_result) {
+            // not waited for, so not left running either - best effort. the last stage knows the group of the pipeline.
+            if (0 < children[command->stage_count - 1].pgid) {
+                killpg(children[command->stage_count - 1].pgid, SIGKILL);
+            }
+            for (size_t i = 0; i < command->stage_count; ++i) {
+                reaper_forget(&children[i]);    // nothing is left registered on failure.
+            }
+        }
+        cgroup_release(&children[command->stage_count - 1]);
+        if (GENERAL_SUCCESS != wait_result) {
+            goto cleanup;
+        }
+        // the children print and handle their own errors - the status is only kept for $?, && and ||.
+        last_status = pipeline_status(children, command->stage_count);
+    }
+
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    if (NULL != job) {
+        job_free(job);
+    }
+    return return_code;
+}
+
+/*
+ * Copies the whole file from_fd into to_fd (both regular files, to_fd empty) - shares the blocks when the file system
+ * can (reflink), copies in the kernel otherwise.
+*/
+static int copy_file(int from_fd, int to_fd)
+{
+    struct stat from_stat;
+    off_t offset = 0;
+
+    if (0 == ioctl(to_fd, FICLONE, from_fd)) {
+        return GENERAL_SUCCESS;
+    }
+    if (-1 == fstat(from_fd, &from_stat)) {
+        return GENERAL_FAILURE;
+    }
+    while (offset < from_stat.st_size) {
+        ssize_t copied = copy_file_range(from_fd, &offset, to_fd, NULL, (size_t)(from_stat.st_size - offset), 0);
+        if ((-1 == copied) && ((EXDEV == errno) || (EINVAL == errno) || (ENOSYS == errno) || (EOPNOTSUPP == errno))) {
+            copied = sendfile(to_fd, from_fd, &offset, (size_t)(from_stat.st_size - offset));
+        } else if (0 < copied) {
+            continue;   // copy_file_range moves offset itself.
+        }
+        if (-1 == copied) {
+            return GENERAL_FAILURE;
+        }
+        if (0 == copied) {
+            break;  // truncated meanwhile.
+        }
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Whether the output of the command line may be memoized - a single allow-listed command, from a "<" file to a ">" file.
+*/
+static bool memo_is_eligible(const command_t* command)
+{
+    const char* name = command->stages[0].argv[0];
+
+    if ((NULL == memo.dir) || (1 != command->stage_count) || (NULL == command->input_path) || (NULL == command->output_path) ||
+        command->is_append || (NULL != command->error_path) || command->stages[0].is_error_to_output ||
+        command->is_error_to_original_output) {
+        return false;
+    }
+    for (const char* entry = memo.commands; '\0' != *entry; entry += strlen(entry) + 1) {
+        if (0 == strcmp(entry, name)) {
             return true;
         }
     }
     return false;
 }
 
-bool is_background_command(int count, char** arglist)
+/*
+ * The name of the memoized output of the command line - a hash of argv and of the identity and version of its input.
+*/
+static void memo_key(const command_t* command, const struct stat* input_stat, char* key, size_t key_size)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    const uint64_t fingerprint[] = {
+        (uint64_t)input_stat->st_dev, (uint64_t)input_stat->st_ino, (uint64_t)input_stat->st_size,
+        (uint64_t)input_stat->st_mtim.tv_sec, (uint64_t)input_stat->st_mtim.tv_nsec,
+    };
+    const unsigned char* bytes = (const unsigned char*)fingerprint;
+
+    for (int i = 0; i < command->stages[0].argc; ++i) {
+        // including the terminating NUL, so that word boundaries count.
+        for (const unsigned char* c = (const unsigned char*)command->stages[0].argv[i]; ; ++c) {
+            hash = (hash ^ *c) * FNV_PRIME;
+            if ('\0' == *c) {
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < sizeof(fingerprint); ++i) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    snprintf(key, key_size, "%s/%016llx", memo.dir, (unsigned long long)hash);
+}
+
+/*
+ * Keeps the output of a command line that succeeded, unless its input changed while it ran - best effort.
+ * Written aside and renamed into place, so a memoized output is always complete.
+*/
+static void memo_store(const command_t* command, const struct stat* input_stat, const char* key)
 {
-    // If a command line contains the & symbol, then it is the last word of the command line.
-    if (strcmp(arglist[count - 1], "&") == 0) {
-        return true;
+    struct stat after_stat;
+    char temporary[PATH_MAX + 16];  // key, a dot and a pid.
+    int output_fd = -1;
+    int memo_fd = -1;
+
+    if ((-1 == stat(command->input_path, &after_stat)) || (after_stat.st_ino != input_stat->st_ino) ||
+        (after_stat.st_size != input_stat->st_size) || (after_stat.st_mtim.tv_sec != input_stat->st_mtim.tv_sec) ||
+        (after_stat.st_mtim.tv_nsec != input_stat->st_mtim.tv_nsec)) {
+        return;
+    }
+
+    snprintf(temporary, sizeof(temporary), "%s.%d", key, (int)getpid());
+    output_fd = open(command->output_path, (O_RDONLY | O_CLOEXEC));
+    memo_fd = open(temporary, (O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC), (S_IRUSR | S_IWUSR));
+    if ((-1 == output_fd) || (-1 == memo_fd) || (GENERAL_SUCCESS != copy_file(output_fd, memo_fd)) ||
+        (-1 == rename(temporary, key))) {
+        perror("memo store failed");
+        unlink(temporary);
+    }
+    if (-1 != output_fd) {
+        close(output_fd);
+    }
+    if (-1 != memo_fd) {
+        close(memo_fd);
     }
-    return false;
 }
 
-bool is_input_redirection_command(int count, char** arglist)
+/*
+ * Runs an eligible command line (see memo_is_eligible) through the memo - on a hit, its ">" file gets the output
+ * kept from an earlier run with the same argv and input file, without launching anything.
+ * Only commands that are pure functions of their arguments and STDIN belong in the allow-list.
+*/
+int run_memoized_command(const command_t* command)
 {
-    // If a command line contains the < symbol, then it appears one before last on the command line.
-    if ((count >= 2) && (strcmp(arglist[count - 2], "<") == 0)) {
-        return true;
+    struct stat input_stat;
+    char key[PATH_MAX];
+    int memo_fd = -1;
+    launch_spec_t spec = { .stdin_fd = -1, .stdout_fd = -1, .stderr_fd = -1 };
+
+    if (-1 == stat(command->input_path, &input_stat)) {
+        return run_command(command, true);  // reports the failure, just like without the memo.
     }
-    return false;
+    memo_key(command, &input_stat, key, sizeof(key));
+
+    memo_fd = open(key, (O_RDONLY | O_CLOEXEC));
+    if (-1 == memo_fd) {
+        if (GENERAL_SUCCESS != run_command(command, true)) {
+            return GENERAL_FAILURE;
+        }
+        if (0 == last_status) {
+            memo_store(command, &input_stat, key);
+        }
+        return GENERAL_SUCCESS;
+    }
+
+    last_status = 0;
+    if (GENERAL_SUCCESS != output_redirection_preparation_handler(command, &spec)) {
+        fprintf(stderr, "Error: preparation handler failed.\n");
+        last_status = 1;
+    } else if (GENERAL_SUCCESS != copy_file(memo_fd, spec.stdout_fd)) {
+        perror("memo copy failed");
+        last_status = 1;
+    }
+    if (-1 != spec.stdout_fd) {
+        close(spec.stdout_fd);
+    }
+    close(memo_fd);
+    return GENERAL_SUCCESS;
+}
+
+static void init_memo(void)
+{
+    const char* dir = getenv(MEMO_DIR_ENV);
+    const char* commands = getenv(MEMO_COMMANDS_ENV);
+    char* end = NULL;
+
+    if ((NULL == dir) || ('\0' == *dir) || (NULL == commands)) {
+        return;
+    }
+    memo.commands = (char*)malloc(strlen(commands) + 2);
+    if (NULL == memo.commands) {
+        return;     // best effort - runs without the memo.
+    }
+    // split into the names once, so that a command is matched exactly - empty names are dropped.
+    end = memo.commands;
+    for (const char* name = commands; '\0' != *name; name += strcspn(name, ",")) {
+        name += strspn(name, ",");
+        size_t length = strcspn(name, ",");
+        if (0 != length) {
+            memcpy(end, name, length);
+            end[length] = '\0';
+            end += length + 1;
+        }
+    }
+    *end = '\0';
+    memo.dir = (char*)dir;
+}
+
+/*
+ * MYSHELL_CGROUP_PARENT (a cgroup v2 directory, not holding any process itself) turns on a cgroup leaf per pipeline.
+ * MYSHELL_CGROUP_CPU_MAX, MYSHELL_CGROUP_MEMORY_MAX and MYSHELL_CGROUP_IO_MAX are the limits of every leaf, written as
+ * they are to its cpu.max, memory.max and io.max. An unusable parent is reported, and the shell runs without cgroups.
+*/
+static void init_cgroups(void)
+{
+    const char* parent = getenv(CGROUP_PARENT_ENV);
+    const struct {
+        const char* value;
+        const char* controller;
+    } limits[] = {
+        { getenv(CGROUP_CPU_MAX_ENV), "+cpu" }, { getenv(CGROUP_MEMORY_MAX_ENV), "+memory" }, { getenv(CGROUP_IO_MAX_ENV), "+io" },
+    };
+
+    if ((NULL == parent) || ('\0' == *parent)) {
+        return;
+    }
+    cgroups.parent_fd = open(parent, (O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (-1 == cgroups.parent_fd) {
+        fprintf(stderr, "%s: %s: %s\n", CGROUP_PARENT_ENV, parent, strerror(errno));
+        return;
+    }
+    cgroups.cpu_max = limits[0].value;
+    cgroups.memory_max = limits[1].value;
+    cgroups.io_max = limits[2].value;
+    for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); ++i) {
+        if (NULL != limits[i].value) {
+            // the leaves only have the files of the controllers enabled in their parent. best effort - a limit that
+            // cannot be set is reported with the first pipeline.
+            write_cgroup_file(cgroups.parent_fd, "cgroup.subtree_control", limits[i].controller);
+        }
+    }
+
+    cgroups.shared_spec = (launch_spec_t*)mmap(NULL, sizeof(launch_spec_t), (PROT_READ | PROT_WRITE),
+                                               (MAP_SHARED | MAP_ANONYMOUS), -1, 0);
+    // without it, the children move themselves into their leaves (see launch_child).
+    cgroups.has_clone_into_cgroup = (MAP_FAILED != cgroups.shared_spec);
+}
+
+/*
+ * Writes the captured output of a parallel command line to STDOUT.
+*/
+static int emit_capture(int capture_fd)
+{
+    struct stat capture_stat;
+    off_t offset = 0;
+
+    fflush(stdout); // anything the shell printed itself comes first.
+    if (-1 == fstat(capture_fd, &capture_stat)) {
+        perror("fstat failed");
+        return GENERAL_FAILURE;
+    }
+
+    while (offset < capture_stat.st_size) {
+        ssize_t sent = sendfile(STDOUT_FILENO, capture_fd, &offset, (size_t)(capture_stat.st_size - offset));
+        if ((-1 == sent) && (EINTR == errno)) {
+            continue;
+        }
+        if ((-1 == sent) && (EINVAL == errno)) {
+            break;  // e.g. STDOUT opened with O_APPEND - copy through a buffer instead.
+        }
+        if (-1 == sent) {
+            perror("sendfile failed");
+            return GENERAL_FAILURE;
+        }
+        if (0 == sent) {
+            return GENERAL_SUCCESS;
+        }
+    }
+
+    while (offset < capture_stat.st_size) {
+        char buffer[CAPTURE_COPY_SIZE];
+        ssize_t length = pread(capture_fd, buffer, sizeof(buffer), offset);
+        if ((-1 == length) && (EINTR == errno)) {
+            continue;
+        }
+        if (-1 == length) {
+            perror("pread failed");
+            return GENERAL_FAILURE;
+        }
+        if (0 == length) {
+            break;
+        }
+        for (ssize_t written = 0; written < length;) {
+            ssize_t result = write(STDOUT_FILENO, buffer + written, (size_t)(length - written));
+            if ((-1 == result) && (EINTR == errno)) {
+                continue;
+            }
+            if (-1 == result) {
+                perror("write failed");
+                return GENERAL_FAILURE;
+            }
+            written += result;
+        }
+        offset += length;
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Emits the outputs of parallel command lines that are done, in submission order - stops at the first one still running.
+*/
+int parallel_flush(void)
+{
+    job_t* job = jobs.head;
+
+    while (NULL != job) {
+        job_t* next = job->next;
+        if (-1 != job->capture_fd) {
+            if (!job_is_done(job)) {
+                break;
+            }
+            if (GENERAL_SUCCESS != emit_capture(job->capture_fd)) {
+                return GENERAL_FAILURE;
+            }
+            last_status = job_exit_status(job);     // in submission order, like the outputs.
+            job_remove(job);
+        }
+        job = next;
+    }
+    return GENERAL_SUCCESS;
+}
+
+static int parallel_running_count(void)
+{
+    int running = 0;
+    for (job_t* job = jobs.head; NULL != job; job = job->next) {
+        if ((-1 != job->capture_fd) && !job_is_done(job)) {
+            running++;
+        }
+    }
+    return running;
+}
+
+/*
+ * Waits for every parallel command line and emits their outputs - before anything that must observe their effects.
+*/
+int parallel_drain(void)
+{
+    for (job_t* job = jobs.head; NULL != job; job = job->next) {
+        if ((-1 != job->capture_fd) && (GENERAL_SUCCESS != wait_children(job->children, job->child_count))) {
+            return GENERAL_FAILURE;
+        }
+    }
+    return parallel_flush();
 }
 
-bool is_output_redirection_command(int count, char** arglist)
+/*
+ * Runs a foreground command line in parallel mode - launched once fewer than max_jobs are running, without waiting for it.
+ * Its STDOUT is captured and emitted by parallel_flush, so outputs are not interleaved and keep the order of the input.
+*/
+int run_parallel_command(const command_t* command)
+{
+    int return_code = GENERAL_FAILURE;
+    job_t* job = NULL;
+
+    // keep at most max_jobs running - reap until one of them is done.
+    while (parallel_running_count() >= parallel.max_jobs) {
+        if ((GENERAL_SUCCESS != reaper_poll(-1)) || (GENERAL_SUCCESS != parallel_flush())) {
+            goto cleanup;
+        }
+    }
+
+    job = job_create(command);
+    if (NULL == job) {
+        perror("malloc failed");
+        goto cleanup;
+    }
+    job->capture_fd = memfd_create("myshell-capture", MFD_CLOEXEC);
+    if (-1 == job->capture_fd) {
+        perror("memfd_create failed");
+        goto cleanup;
+    }
+
+    const int stdio_fds[3] = { -1, job->capture_fd, -1 };
+    if (GENERAL_SUCCESS != launch_pipeline(command, job->children, true, false, stdio_fds)) {
+        goto cleanup;
+    }
+    parallel.launched++;
+    if (job_is_launched(job)) {
+        job_add(job);
+        job = NULL;     // owned by the job table now, until its output is emitted.
+    }
+
+    return_code = parallel_flush();
+cleanup:
+    if (NULL != job) {
+        job_free(job);
+    }
+    return return_code;
+}
+
+/*
+ * Launches a step whose dependencies succeeded, as a job. A command line that cannot be launched fails the step.
+*/
+static int step_launch(step_t* step)
+{
+    int return_code = GENERAL_FAILURE;
+    job_t* job = NULL;
+
+    step->state = STEP_FAILED;
+    if (GENERAL_SUCCESS != classify_command(step->argc, step->argv, step->kinds, &dag.command)) {
+        return GENERAL_SUCCESS;     // validated when declared - out of memory.
+    }
+
+    job = job_create(&dag.command);
+    if (NULL == job) {
+        perror("malloc failed");
+        goto cleanup;
+    }
+    // like any foreground command line, steps terminate upon SIGINT.
+    if (GENERAL_SUCCESS != launch_pipeline(&dag.command, job->children, true, false, NULL)) {
+        goto cleanup;
+    }
+    if (job_is_launched(job)) {
+        job_add(job);
+        step->job = job;
+        step->state = STEP_RUNNING;
+        dag.running++;
+        job = NULL;     // owned by the job table, until the step completes.
+    }
+
+    return_code = GENERAL_SUCCESS;
+cleanup:
+    if (NULL != job) {
+        job_free(job);
+    }
+    free(step->argv);
+    step->argv = NULL;
+    free(step->kinds);
+    step->kinds = NULL;
+    return return_code;
+}
+
+/*
+ * Completes the steps whose jobs are done, and launches the steps that became ready - as long as workers are free.
+ * A step whose dependency failed is skipped, and fails in turn.
+*/
+int steps_update(void)
+{
+    for (size_t i = dag.first_unfinished; i < dag.count; ++i) {
+        step_t* step = &dag.steps[i];
+
+        if ((STEP_RUNNING == step->state) && job_is_done(step->job)) {
+            int status = job_exit_status(step->job);
+            step->state = (0 == status) ? STEP_SUCCEEDED : STEP_FAILED;
+            if (0 != status) {
+                fprintf(stderr, "step %s: exit %d\n", step->name, status);
+            }
+            job_remove(step->job);
+            step->job = NULL;
+            dag.running--;
+        }
+    }
+
+    // dependencies always come before their dependents, so a single pass sees every cascade.
+    for (size_t i = dag.first_unfinished; i < dag.count; ++i) {
+        step_t* step = &dag.steps[i];
+        bool is_ready = true;
+
+        if (STEP_PENDING != step->state) {
+            continue;
+        }
+        for (size_t j = 0; j < step->dependency_count; ++j) {
+            const step_t* dependency = &dag.steps[step->dependencies[j]];
+            if (STEP_FAILED == dependency->state) {
+                fprintf(stderr, "step %s: skipped, %s failed\n", step->name, dependency->name);
+                step->state = STEP_FAILED;
+                free(step->argv);
+                step->argv = NULL;
+                free(step->kinds);
+                step->kinds = NULL;
+                break;
+            }
+            if (STEP_SUCCEEDED != dependency->state) {
+                is_ready = false;
+            }
+        }
+        if ((STEP_PENDING == step->state) && is_ready && (dag.running < dag.max_running)) {
+            if (GENERAL_SUCCESS != step_launch(step)) {
+                return GENERAL_FAILURE;
+            }
+        }
+    }
+
+    while ((dag.first_unfinished < dag.count) &&
+           ((STEP_SUCCEEDED == dag.steps[dag.first_unfinished].state) || (STEP_FAILED == dag.steps[dag.first_unfinished].state))) {
+        dag.first_unfinished++;
+    }
+    return GENERAL_SUCCESS;
+}
+
+/*
+ * Runs every declared step to completion - before anything that must observe their effects.
+*/
+int steps_drain(void)
 {
-    // If a command line contains the > symbol, then it appears one before last on the command line.
-    if ((count >= 2) && (strcmp(arglist[count - 2], ">") == 0)) {
-        return true;
+    if (GENERAL_SUCCESS != steps_update()) {
+        return GENERAL_FAILURE;
     }
-    return false;
+    while (0 < dag.running) {
+        if ((GENERAL_SUCCESS != reaper_poll(-1)) || (GENERAL_SUCCESS != steps_update())) {
+            return GENERAL_FAILURE;
+        }
+    }
+    return GENERAL_SUCCESS;
 }
 
-int count_pipes(int count, char** arglist)
+static step_t* step_find(const char* name)
 {
-    int pipe_count = 0;
-    for (int i = 0; i < count; ++i) {
-        if (strcmp(arglist[i], "|") == 0) {
-            pipe_count++;
+    for (size_t i = 0; i < dag.count; ++i) {
+        if (0 == strcmp(dag.steps[i].name, name)) {
+            return &dag.steps[i];
         }
     }
-    return pipe_count;
+    return NULL;
 }
 
-void set_pipes_to_null(int count, char** arglist)
+static void steps_destroy(void)
 {
-    for (int i = 0; i < count; ++i) {
-        if (strcmp(arglist[i], "|") == 0) {
-            arglist[i] = NULL;
-        }
+    for (size_t i = 0; i < dag.count; ++i) {
+        free(dag.steps[i].name);
+        free(dag.steps[i].argv);
+        free(dag.steps[i].kinds);
+        free(dag.steps[i].dependencies);
     }
+    free(dag.steps);
+    free(dag.command.stages);
+    free(dag.command.children);
 }
 
 /*
- * Assumes input (arglist) is valid - the last two arguments are "<" and a filename.
+ * step NAME [after: STEP...] -- COMMAND
+ * Declares a step of the dependency graph - COMMAND runs once every step it comes after has succeeded, without waiting
+ * for the command lines that follow. Dependencies are declared before their dependents, so the graph has no cycles.
+ * Steps run on up to -j workers (or one per CPU). Any other command line waits for all the steps before it.
+ * returns COMMAND_SYNTAX_ERROR if the step is dropped.
 */
-int input_redirection_preparation_handler(int count, char** arglist)
+int run_step_declaration(int count, char** arglist, const char* kinds)
 {
-    int return_code = GENERAL_FAILURE;
-    int fd = -1;
+    int separator = 2;
+    int dependencies_start = 0;
+    step_t step = { .state = STEP_PENDING };
+    size_t words_size = 0;
+    char* words = NULL;
 
-    fd = open(arglist[count - 1], O_RDONLY, (S_IRUSR | S_IWUSR));
-    if (-1 == fd) {
-        perror("open failed");
-        goto cleanup;
+    if ((count < 2) || ('\0' != kinds[1]) || (NULL != step_find(arglist[1]))) {
+        goto syntax_error;
+    }
+    if ((separator < count) && (0 == strcmp(arglist[separator], "after:"))) {
+        dependencies_start = ++separator;
+    }
+    while ((separator < count) && (0 != strcmp(arglist[separator], "--"))) {
+        if ((0 == dependencies_start) || ('\0' != kinds[separator]) || (NULL == step_find(arglist[separator]))) {
+            goto syntax_error;
+        }
+        separator++;
+    }
+    if (separator + 1 >= count) {
+        goto syntax_error;
     }
 
-    // setting STDIN in the child process to be the file. This does not affect the parent process.
-    if (-1 == dup2(fd, STDIN_FILENO)) {
-        perror("dup2 failed");
-        goto cleanup;
+    // a private copy of the command words - the line's words are reused by the next line.
+    step.argc = count - (separator + 1);
+    for (int i = separator + 1; i < count; ++i) {
+        words_size += strlen(arglist[i]) + 1;
+    }
+    step.name = strdup(arglist[1]);
+    step.argv = (char**)malloc((step.argc + 1) * sizeof(char*) + words_size);
+    step.kinds = (char*)malloc(step.argc);
+    step.dependency_count = (0 == dependencies_start) ? 0 : (size_t)(separator - dependencies_start);
+    step.dependencies = (size_t*)malloc((step.dependency_count + 1) * sizeof(size_t));
+    if ((NULL == step.name) || (NULL == step.argv) || (NULL == step.kinds) || (NULL == step.dependencies)) {
+        perror("malloc failed");
+        goto fail;
+    }
+    words = (char*)&step.argv[step.argc + 1];
+    for (int i = 0; i < step.argc; ++i) {
+        step.argv[i] = words;
+        words = stpcpy(words, arglist[separator + 1 + i]) + 1;
+        step.kinds[i] = kinds[separator + 1 + i];
+    }
+    step.argv[step.argc] = NULL;
+    for (size_t i = 0; i < step.dependency_count; ++i) {
+        step.dependencies[i] = (size_t)(step_find(arglist[dependencies_start + i]) - dag.steps);
     }
 
-    arglist[count - 2] = NULL; // remove the "<" and filename from arglist for execvp.
+    // the command line itself is checked now, and classified again (from the copy) when launched.
+    switch (classify_command(step.argc, &arglist[separator + 1], &kinds[separator + 1], &current_command)) {
+    case GENERAL_SUCCESS:
+        break;
+    case COMMAND_SYNTAX_ERROR:
+        goto drop;
+    default:
+        goto fail;
+    }
+    if (current_command.is_background) {
+        goto syntax_error;
+    }
 
-    return_code = GENERAL_SUCCESS;
-cleanup:
-    if (-1 != fd) {
-        close(fd);
+    if (dag.count == dag.capacity) {
+        size_t new_capacity = (0 == dag.capacity) ? INITIAL_PIPELINE_CAPACITY : (2 * dag.capacity);
+        step_t* new_steps = (step_t*)realloc(dag.steps, new_capacity * sizeof(step_t));
+        if (NULL == new_steps) {
+            perror("realloc failed");
+            goto fail;
+        }
+        dag.steps = new_steps;
+        dag.capacity = new_capacity;
     }
-    return return_code;
+    if (0 == dag.max_running) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        dag.max_running = (0 != parallel.max_jobs) ? parallel.max_jobs : ((cpus > 0) ? (int)cpus : 1);
+    }
+    dag.steps[dag.count++] = step;
+    return steps_update();
+
+syntax_error:
+    fprintf(stderr, "Error: usage: step NAME [after: STEP...] -- COMMAND (with earlier, distinct step names)\n");
+drop:
+    free(step.name);
+    free(step.argv);
+    free(step.kinds);
+    free(step.dependencies);
+    return COMMAND_SYNTAX_ERROR;
+fail:
+    free(step.name);
+    free(step.argv);
+    free(step.kinds);
+    free(step.dependencies);
+    return GENERAL_FAILURE;
 }
 
 /*
- * Assumes input (arglist) is valid - the last two arguments are ">" and a filename.
+ * Turns on parallel mode (-j N) - up to max_jobs foreground command lines run at once.
+ * Command lines are assumed to be independent - only builtins and background command lines wait for the ones before them.
 */
-int output_redirection_preparation_handler(int count, char** arglist)
+int set_parallel_jobs(int max_jobs)
 {
-    int return_code = GENERAL_FAILURE;
-    int fd = -1;
-
-    fd = open(arglist[count - 1], (O_RDWR | O_CREAT | O_TRUNC), (S_IRUSR | S_IWUSR));
-    if (-1 == fd) {
-        perror("open failed");
-        goto cleanup;
-    }
-
-    // setting STDOUT in the child process to be the file. This does not affect the parent process.
-    if (-1 == dup2(fd, STDOUT_FILENO)) {
-        perror("dup2 failed");
-        goto cleanup;
+    if (max_jobs < 1) {
+        fprintf(stderr, "Error: invalid number of parallel jobs.\n");
+        return GENERAL_FAILURE;
     }
+    parallel.max_jobs = max_jobs;
+    clock_gettime(CLOCK_MONOTONIC, &parallel.start_time);
+    return GENERAL_SUCCESS;
+}
 
-    arglist[count - 2] = NULL; // remove the ">" and filename from arglist for execvp.
+static int client_reply(client_t* client, int status)
+{
+    char reply[16];
+    int length = snprintf(reply, sizeof(reply), "%d\n", status);
+    return (length == send(client->socket_fd, reply, (size_t)length, MSG_NOSIGNAL)) ? GENERAL_SUCCESS : GENERAL_FAILURE;
+}
 
-    return_code = GENERAL_SUCCESS;
-cleanup:
-    if (-1 != fd) {
-        close(fd);
+static void client_free(int epoll_fd, client_t* client)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->socket_fd, NULL);
+    close(client->socket_fd);
+    for (int i = 0; i < 3; ++i) {
+        if (-1 != client->stdio_fds[i]) {
+            close(client->stdio_fds[i]);
+        }
     }
-    return return_code;
+    if (NULL != client->job) {
+        job_free(client->job);
+    }
+    free(client);
 }
 
-int run_command_internal(int count, char** arglist, bool is_foreground, cmd_preparation_handler_t preparation_handler)
+/*
+ * Reads a command line from the client, and launches it without waiting. The client is not polled again until its
+ * exit status is sent (see server_complete). A command line that is not launched is answered right away.
+ * returns GENERAL_FAILURE on a shell (parent process) failure, COMMAND_SYNTAX_ERROR if the client should be dropped.
+*/
+static int server_read_client(int epoll_fd, client_t* client)
 {
-    int return_code = GENERAL_FAILURE;
-    pid_t pid = fork();
-    if (-1 == pid) {
-        perror("fork failed");
-        goto cleanup;
-    } else if (0 == pid) {
-        // child process
-        // on errors, the child process calls exit. this does not cause the shell (parent process) to exit, only the child process.
+    static char line[SERVER_LINE_SIZE + 1];
+    static char* arglist[SERVER_LINE_SIZE / 2 + 1];
+    static char kinds[SERVER_LINE_SIZE / 2];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { .iov_base = line, .iov_len = SERVER_LINE_SIZE };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t length = recvmsg(client->socket_fd, &message, MSG_CMSG_CLOEXEC);
+    int count = 0;
+    int status = SYNTAX_ERROR_STATUS;
+    job_t* job = NULL;
 
-        if (SIG_ERR == signal(SIGCHLD, SIG_DFL)) {  // restore default behavior for SIGCHLD before execvp.
-            perror("signal failed");
-            exit(1);
-        }
+    if ((-1 == length) && ((EINTR == errno) || (EAGAIN == errno))) {
+        return GENERAL_SUCCESS;
+    }
+    if (0 >= length) {
+        return COMMAND_SYNTAX_ERROR;    // hung up.
+    }
 
-        if (is_foreground) {
-            // Foreground child processes should terminate upon SIGINT.
-            if (SIG_ERR == signal(SIGINT, SIG_DFL)) {  // restore default behavior for SIGINT before execvp.
-                perror("signal failed");
-                exit(1);
+    // new stdio fds (STDIN, STDOUT, STDERR) replace the previous ones, for this and the following command lines.
+    // the control buffer is padded to a multiple of 8 bytes, so the kernel may deliver more fds than fit in fds.
+    // on too many (or truncated) fds, all the ones received are closed and the command line is rejected.
+    bool is_fd_overflow = (0 != (message.msg_flags & MSG_CTRUNC));
+    struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+    if ((NULL != header) && (SOL_SOCKET == header->cmsg_level) && (SCM_RIGHTS == header->cmsg_type)) {
+        int fds[3];
+        size_t fd_count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        is_fd_overflow |= (fd_count > 3);
+        for (size_t i = 0; i < fd_count; ++i) {
+            int fd = -1;
+            memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+            if (is_fd_overflow) {
+                close(fd);
+            } else {
+                fds[i] = fd;
             }
         }
-
-        if (NULL != preparation_handler) {
-            // call child handler for preprocessing (for redirections)
-            if (GENERAL_SUCCESS != preparation_handler(count, arglist)) {
-                fprintf(stderr, "Error: preparation handler failed.\n");
-                exit(1);
+        for (size_t i = 0; (i < 3) && !is_fd_overflow; ++i) {
+            if (-1 != client->stdio_fds[i]) {
+                close(client->stdio_fds[i]);
             }
+            client->stdio_fds[i] = (i < fd_count) ? fds[i] : -1;
         }
+    }
+    if (is_fd_overflow) {
+        fprintf(stderr, "Error: too many fds passed.\n");
+        return (GENERAL_SUCCESS == client_reply(client, SYNTAX_ERROR_STATUS)) ? GENERAL_SUCCESS : COMMAND_SYNTAX_ERROR;
+    }
+    if (0 != (message.msg_flags & MSG_TRUNC)) {
+        fprintf(stderr, "Error: command line too long.\n");
+        return (GENERAL_SUCCESS == client_reply(client, SYNTAX_ERROR_STATUS)) ? GENERAL_SUCCESS : COMMAND_SYNTAX_ERROR;
+    }
 
-        if (-1 == execvp(arglist[0], arglist)) {   // should not return from here unless error.
-            perror("execvp failed");
-            exit(1);
-        }
-        // should not reach here. just to verify child always exists.
-        fprintf(stderr, "Error: execvp unknown behaviour.\n");
-        exit(1);
-    } else {
-        // parent process
-        if (is_foreground) {
-            // ECHILD and EINTR are not considered an actual error that requires exiting the shell.
-            if ((-1 == waitpid(pid, NULL, 0)) && (errno != ECHILD) && (errno != EINTR)) {
-                perror("waitpid failed");
-                goto cleanup;
-            }
-            // not checking child status, assuming child prints and handles its own errors.
-        } else {
-            waitpid(-1, NULL, WNOHANG); // reap any zombie processes that are already done - best effort.
+    // split into words, just like the tokenizer of the shell's input.
+    line[length] = '\0';
+    for (char* word = strtok(line, " \t\r\n"); NULL != word; word = strtok(NULL, " \t\r\n")) {
+        kinds[count] = word_kind(word);
+        if (('A' == kinds[count]) || ('O' == kinds[count])) {
+            fprintf(stderr, "Error: && and || are not supported in server mode.\n");
+            goto reply;
         }
+        arglist[count++] = word;
+    }
+    arglist[count] = NULL;
+    if (0 == count) {
+        status = 0;
+        goto reply;
     }
 
-    return_code = GENERAL_SUCCESS;
-cleanup:
-    return return_code;
-}
+    switch (classify_command(count, arglist, kinds, &current_command)) {
+    case GENERAL_SUCCESS:
+        break;
+    case COMMAND_SYNTAX_ERROR:
+        goto reply;
+    default:
+        return GENERAL_FAILURE;
+    }
 
-int run_command(int count, char** arglist, bool is_foreground)
-{
-    return run_command_internal(count, arglist, is_foreground, NULL);
-}
+    // every command line runs until its status is sent - a trailing & is accepted, and changes nothing.
+    job = job_create(&current_command);
+    if (NULL == job) {
+        perror("malloc failed");
+        return GENERAL_FAILURE;
+    }
+    if (GENERAL_SUCCESS != launch_pipeline(&current_command, job->children, true, false, client->stdio_fds)) {
+        job_free(job);
+        return GENERAL_FAILURE;
+    }
+    if (!job_is_launched(job)) {
+        status = job_exit_status(job);
+        job_free(job);
+        goto reply;
+    }
 
-int run_input_redirection_command(int count, char** arglist)
-{
-    // A command line will contain at most one type of special operation, so input redirection is always a foreground command.
-    return run_command_internal(count, arglist, true, input_redirection_preparation_handler);
+    client->job = job;
+    // the following command lines (and a hang up) wait in the socket until this one is done.
+    if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->socket_fd, NULL)) {
+        perror("epoll_ctl failed");
+        return GENERAL_FAILURE;
+    }
+    return GENERAL_SUCCESS;
+
+reply:
+    return (GENERAL_SUCCESS == client_reply(client, status)) ? GENERAL_SUCCESS : COMMAND_SYNTAX_ERROR;
 }
 
-int run_output_redirection_command(int count, char** arglist)
+/*
+ * Sends the exit status of every command line that is done, and resumes reading from its client.
+*/
+static int server_complete(int epoll_fd, client_t** clients)
 {
-    // A command line will contain at most one type of special operation, so output redirection is always a foreground command.
-    return run_command_internal(count, arglist, true, output_redirection_preparation_handler);
+    client_t** link = clients;
+
+    while (NULL != *link) {
+        client_t* client = *link;
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+
+        if ((NULL == client->job) || !job_is_done(client->job)) {
+            link = &client->next;
+            continue;
+        }
+
+        int status = job_exit_status(client->job);
+        job_free(client->job);
+        client->job = NULL;
+        if (GENERAL_SUCCESS != client_reply(client, status)) {
+            *link = client->next;
+            client_free(epoll_fd, client);
+            continue;
+        }
+        if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->socket_fd, &event)) {
+            perror("epoll_ctl failed");
+            return GENERAL_FAILURE;
+        }
+        link = &client->next;
+    }
+    return GENERAL_SUCCESS;
 }
 
-int run_piped_commands(int count, char** arglist)
+/*
+ * Server mode - accepts connections on a UNIX (SOCK_SEQPACKET) socket at socket_path, and serves them until killed.
+ * Each message is a command line (an empty one hangs up), answered by its exit status as a line of text.
+ * A message may carry (SCM_RIGHTS) the STDIN, STDOUT and STDERR for the command lines of its connection. Connections are served concurrently,
+ * each runs its command lines one at a time. Command lines run as external commands - builtins are not available.
+ * Each command line is a single pipeline - and-or lists ("&&", "||") are rejected with status 2, and "$?" is not expanded.
+ * returns GENERAL_FAILURE on failure.
+*/
+int serve(const char* socket_path)
 {
     int return_code = GENERAL_FAILURE;
-    int arglist_index = 0;
-    int pipe_from_prev[2] = { -1, -1 };
-    int pipe_to_next[2] = { -1, -1 };
-    int pids[10] = { 0 };
-    int pipe_count = count_pipes(count, arglist);
-    set_pipes_to_null(count, arglist);
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    client_t* clients = NULL;
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    struct epoll_event event = { .events = EPOLLIN };
 
-    if (9 < pipe_count) {
-        fprintf(stderr, "Error: too many pipes (maximum allowed is 10 commands).\n");
-        // drop the pipeline command and continue to the next one.
-        return_code = GENERAL_SUCCESS;  // not considered a shell (parent process) failure.
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: socket path too long.\n");
+        return GENERAL_FAILURE;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    listen_fd = socket(AF_UNIX, (SOCK_SEQPACKET | SOCK_CLOEXEC), 0);
+    if (-1 == listen_fd) {
+        perror("socket failed");
         goto cleanup;
     }
+    unlink(socket_path);    // left behind by a previous server - best effort.
+    if ((-1 == bind(listen_fd, (struct sockaddr*)&address, sizeof(address))) || (-1 == listen(listen_fd, SOMAXCONN))) {
+        perror("bind failed");
+        goto cleanup;
+    }
+
+    // the reaper's epoll set is nested, so children exiting wake the server up as well.
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == epoll_fd) {
+        perror("epoll_create1 failed");
+        goto cleanup;
+    }
+    event.data.ptr = &listen_fd;
+    if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event)) {
+        perror("epoll_ctl failed");
+        goto cleanup;
+    }
+    event.data.ptr = &reaper;
+    if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reaper.epoll_fd, &event)) {
+        perror("epoll_ctl failed");
+        goto cleanup;
+    }
+
+    for (;;) {
+        struct epoll_event events[SERVER_MAX_EVENTS];
+        int event_count = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
 
-    // run commands concurrently in a pipeline
-    for (int i = 0; i <= pipe_count; i++) {
-        // for each command pair inthe pipeline
-        if ((i < pipe_count) && (-1 == pipe(pipe_to_next))) {
-            perror("pipe failed");
+        if ((-1 == event_count) && (EINTR != errno)) {
+            perror("epoll_wait failed");
             goto cleanup;
         }
 
-        pid_t pid = fork();
-        if (-1 == pid) {
-            perror("fork failed");
-            goto cleanup;
-        } else if (0 == pid) {
-            // child process
-            // on errors, the child process calls exit. this does not cause the shell (parent process) to exit, only the child process.
-            
-            // close read end of pipe to next, this child only writes to it.
-            // (writing end of pipe from prev is expected to be closed by the parent before fork)
-            if (-1 != pipe_to_next[0]) {
-                close(pipe_to_next[0]);
-                pipe_to_next[0] = -1;
-            }
-
-            if (SIG_ERR == signal(SIGCHLD, SIG_DFL)) {  // restore default behavior for SIGCHLD before execvp.
-                perror("signal failed");
-                exit(1);
-            }
-
-            // Foreground child processes should terminate upon SIGINT.
-            if (SIG_ERR == signal(SIGINT, SIG_DFL)) {  // restore default behavior for SIGINT before execvp.
-                perror("signal failed");
-                exit(1);
-            }
-            
-            if (i > 0) {
-                // not the first command - set stdin to be the read end of the previous pipe
-                if (-1 == dup2(pipe_from_prev[0], STDIN_FILENO)) {
-                    perror("dup2 failed");
-                    exit(1);
+        for (int i = 0; i < event_count; ++i) {
+            if (&reaper == events[i].data.ptr) {
+                if ((GENERAL_SUCCESS != reaper_poll(0)) || (GENERAL_SUCCESS != server_complete(epoll_fd, &clients))) {
+                    goto cleanup;
                 }
-
-                close(pipe_from_prev[0]); // close after dup, best effort.
-                pipe_from_prev[0] = -1;
-            }
-            if (i < pipe_count) {
-                // not the last command - set stdout to be the write end of the next pipe
-                if (-1 == dup2(pipe_to_next[1], STDOUT_FILENO)) {
-                    perror("dup2 failed");
-                    exit(1);
+            } else if (&listen_fd == events[i].data.ptr) {
+                client_t* client = NULL;
+                int socket_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+                if (-1 == socket_fd) {
+                    perror("accept failed");   // e.g. out of fds - the other clients are still served.
+                    continue;
+                }
+                client = (client_t*)calloc(1, sizeof(client_t));
+                if (NULL == client) {
+                    perror("calloc failed");
+                    close(socket_fd);
+                    continue;
+                }
+                client->socket_fd = socket_fd;
+                client->stdio_fds[0] = client->stdio_fds[1] = client->stdio_fds[2] = -1;
+                event.data.ptr = client;
+                if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event)) {
+                    perror("epoll_ctl failed");
+                    close(socket_fd);
+                    free(client);
+                    continue;
+                }
+                client->next = clients;
+                clients = client;
+            } else {
+                client_t* client = (client_t*)events[i].data.ptr;
+                int result = server_read_client(epoll_fd, client);
+                if (GENERAL_FAILURE == result) {
+                    goto cleanup;
+                }
+                if (COMMAND_SYNTAX_ERROR == result) {
+                    // hung up.
+                    client_t** link = &clients;
+                    while (client != *link) {
+                        link = &(*link)->next;
+                    }
+                    *link = client->next;
+                    client_free(epoll_fd, client);
                 }
-
-                close(pipe_to_next[1]); // close after dup, best effort.
-                pipe_to_next[1] = -1;
-            }
- 
-            if (-1 == execvp(arglist[arglist_index], &arglist[arglist_index])) {
-                // should not return here unless error.
-                perror("execvp failed");
-                exit(1);
             }
-        } else {
-            // parent process
+        }
+    }
 
-            pids[i] = pid;  // save all pids to wait for them later.
+cleanup:
+    while (NULL != clients) {
+        client_t* next = clients->next;
+        client_free(epoll_fd, clients);
+        clients = next;
+    }
+    if (-1 != epoll_fd) {
+        close(epoll_fd);
+    }
+    if (-1 != listen_fd) {
+        close(listen_fd);
+        unlink(socket_path);
+    }
+    return return_code;
+}
 
-            // close pipe ends in parent. mark as closed.
-            if (-1 != pipe_from_prev[0]) {
-                close(pipe_from_prev[0]);
-                pipe_from_prev[0] = -1;
-            }
-            if (-1 != pipe_from_prev[1]) {
-                close(pipe_from_prev[1]);
-                pipe_from_prev[1] = -1;
-            }
+int prepare(void)
+{
+    struct sigaction interrupt_action = { .sa_handler = interrupt_handler, .sa_flags = SA_RESTART };
+    sigset_t interrupt_set;
+    // the parent (shell) should not terminate upon SIGINT - it only forwards it to the foreground pipelines.
+    if (-1 == sigaction(SIGINT, &interrupt_action, NULL)) {
+        perror("sigaction failed");
+        return GENERAL_FAILURE;
+    }
+    // caught only while waiting for children (see reaper_poll), and a builtin sleep (see run_sleep_builtin).
+    sigemptyset(&interrupt_set);
+    sigaddset(&interrupt_set, SIGINT);
+    if (-1 == sigprocmask(SIG_BLOCK, &interrupt_set, &wait_sigmask)) {
+        perror("sigprocmask failed");
+        return GENERAL_FAILURE;
+    }
+    sigdelset(&wait_sigmask, SIGINT);
 
-            // close writing end of previous pipe
-            if (-1 != pipe_to_next[1]) {
-                close(pipe_to_next[1]);
-                pipe_to_next[1] = -1;
-            }
+    terminal.shell_pgid = getpgrp();
+    terminal.is_interactive = (1 == isatty(STDIN_FILENO)) && (tcgetpgrp(STDIN_FILENO) == terminal.shell_pgid);
+    if (terminal.is_interactive && (SIG_ERR == signal(SIGTTOU, SIG_IGN))) {  // to take the terminal back.
+        perror("signal failed");
+        return GENERAL_FAILURE;
+    }
 
-            // move up the pipeline. reading end inherited by the next child process.
-            pipe_from_prev[0] = pipe_to_next[0];
-            pipe_to_next[0] = -1;
+    if (GENERAL_SUCCESS != reaper_init()) {   // children are reaped by the reaper to prevent zombies.
+        return GENERAL_FAILURE;
+    }
 
-            // progress arglist to the next command (unless on last command)
-            while (arglist[arglist_index] != NULL) {
-                arglist_index++;
-            }
-            arglist_index++; // skip the NULL
-        }
+    init_trace_fd();
+    init_memo();
+    init_cgroups();
+    read_pipe_max_size();
+    if (NULL != getenv(PIPE_SIZE_ENV)) {
+        set_pipe_buffer_size(getenv(PIPE_SIZE_ENV));   // an invalid value is reported and ignored.
+    }
+    if (NULL != getenv(CPU_POLICY_ENV)) {
+        set_cpu_policy(getenv(CPU_POLICY_ENV));     // an invalid value is reported and ignored.
     }
+    if ((NULL != getenv(ZYGOTE_ENV)) && (0 == strcmp(getenv(ZYGOTE_ENV), "1"))) {
+        zygote_start();
+    }
+
+    return GENERAL_SUCCESS;
+}
 
-    for (int i = 0; i <= pipe_count; i++) {
-        // wait for all child processes to complete
+/*
+ * Replaces every "$?" in the words with the exit status of the last command line - called right before running them,
+ * so in an and-or list it is the status of the previous command line of the list.
+ * The expanded words live in a buffer that is reused by the next call. returns GENERAL_FAILURE if out of memory.
+*/
+static int expand_status(int count, char** arglist)
+{
+    static char* expansion = NULL;
+    static size_t expansion_size = 0;
+    char status[16];
+    size_t status_length = 0;
+    size_t size = 0;
+    char* end = NULL;
 
-        // ECHILD and EINTR are not considered an actual error that requires exiting the shell.
-        if ((-1 == waitpid(pids[i], NULL, 0)) && (errno != ECHILD) && (errno != EINTR)) {
-            perror("waitpid failed");
-            goto cleanup;
+    for (int i = 0; i < count; ++i) {
+        const char* found = strstr(arglist[i], STATUS_WORD);
+        if (NULL == found) {
+            continue;
+        }
+        if (0 == status_length) {
+            status_length = (size_t)snprintf(status, sizeof(status), "%d", last_status);
         }
+        size += strlen(arglist[i]) + 1;
+        for (; NULL != found; found = strstr(found + 2, STATUS_WORD)) {
+            size += status_length;
+        }
+    }
+    if (0 == size) {
+        return GENERAL_SUCCESS;     // the common case - nothing to copy.
     }
 
-    return_code = GENERAL_SUCCESS;
-cleanup:
-    return return_code;
+    if (size > expansion_size) {
+        char* new_expansion = (char*)realloc(expansion, size);
+        if (NULL == new_expansion) {
+            perror("realloc failed");
+            return GENERAL_FAILURE;
+        }
+        expansion = new_expansion;
+        expansion_size = size;
+    }
+
+    end = expansion;
+    for (int i = 0; i < count; ++i) {
+        const char* word = arglist[i];
+        const char* found = strstr(word, STATUS_WORD);
+        if (NULL == found) {
+            continue;
+        }
+        arglist[i] = end;
+        for (; NULL != found; word = found + 2, found = strstr(word, STATUS_WORD)) {
+            memcpy(end, word, (size_t)(found - word));
+            end = stpcpy(end + (found - word), status);
+        }
+        end = stpcpy(end, word) + 1;
+    }
+    return GENERAL_SUCCESS;
 }
 
-int prepare(void)
+/*
+ * Classifies and runs a single command line (no && or ||). In parallel mode, may_run_parallel allows not waiting for it.
+ * returns 1 if should continue, 0 otherwise (error, or the exit builtin).
+*/
+static int run_command_line(int count, char** arglist, const char* kinds, bool may_run_parallel)
 {
-    struct sigaction sa = {0};
-    sa.sa_handler = sigchld_handler;
-    sa.sa_flags = SA_RESTART;
+    int return_value = PROC_ARGLIST_STOP;
+    command_t* command = &current_command;
+    const builtin_t* builtin = NULL;
+    int classify_result = GENERAL_FAILURE;
 
-    if (SIG_ERR == signal(SIGINT, SIG_IGN)) {  // the parent (shell) should not terminate upon SIGINT.
-        perror("signal failed");
-        return GENERAL_FAILURE;
+    // first detect special operations if there are any.
+    classify_result = classify_command(count, arglist, kinds, command);
+    if (COMMAND_SYNTAX_ERROR == classify_result) {
+        // drop the command line and continue to the next one.
+        last_status = SYNTAX_ERROR_STATUS;
+        return_value = PROC_ARGLIST_CONTINUE;
+        goto cleanup;
+    } else if (GENERAL_SUCCESS != classify_result) {
+        goto cleanup;
     }
 
-    if (-1 == sigaction(SIGCHLD, &sa, NULL)) { // set handler for SIGCHLD to prevent zombies.
-        perror("sigaction failed");
-        return GENERAL_FAILURE;
+    builtin = (1 == command->stage_count) ? find_builtin(command->stages[0].argv[0]) : NULL;
+    if ((NULL != builtin) && builtin->is_pure && (0 != parallel.max_jobs) && may_run_parallel) {
+        builtin = NULL;     // observes nothing that came before - runs alongside the other parallel command lines.
     }
-    
-    return GENERAL_SUCCESS;
+    if ((0 != parallel.max_jobs) && (command->is_background || (NULL != builtin) || !may_run_parallel)) {
+        // the other builtins and background jobs observe (or change) what came before - let every parallel command line finish first.
+        if (GENERAL_SUCCESS != parallel_drain()) {
+            goto cleanup;
+        }
+    }
+
+    if (command->is_background) {
+        if (GENERAL_SUCCESS != run_command(command, false)) {
+            goto cleanup;
+        }
+    } else if (NULL != builtin) {
+        // a foreground builtin (with or without redirections) does not need a child process at all.
+        if (GENERAL_SUCCESS != run_builtin_command(command, builtin)) {
+            goto cleanup;
+        }
+        if (is_exit_requested) {
+            goto cleanup;   // stop the shell.
+        }
+    } else if ((0 != parallel.max_jobs) && may_run_parallel) {
+        if (GENERAL_SUCCESS != run_parallel_command(command)) {
+            goto cleanup;
+        }
+    } else if (memo_is_eligible(command)) {
+        if (GENERAL_SUCCESS != run_memoized_command(command)) {
+            goto cleanup;
+        }
+    } else {
+        if (GENERAL_SUCCESS != run_command(command, true)) {
+            goto cleanup;
+        }
+    }
+
+    return_value = PROC_ARGLIST_CONTINUE;
+cleanup:
+    return return_value;
 }
 
 /*
  * This function receives a null-terminated array arglist with count non-NULL words. This array contains the parsed command line.
  * The function executes the command(s) specified in arglist, and waits for their completion if they are foreground commands.
+ * kinds holds the operator of each word ('|', '&', '<', '>', 'A' for "&&", 'O' for "||", 'a' for ">>", 'e' for "2>",
+ * 'd' for "2>&1", 'b' for "&>"), or '\0' for a plain word - as found by the tokenizer.
+ * "a && b" runs b only if a succeeded, "a || b" only if it failed - a command line that is not run is never launched.
  * It assumes count >= 1 and arglist valid.
  * This function does not return until every foreground child process it created exits.
- * returns 1 if should continue, 0 otherwise (error).
+ * returns 1 if should continue, 0 otherwise (error, or the exit builtin).
 */
-int process_arglist(int count, char** arglist)
+int process_tokenized_arglist(int count, char** arglist, const char* kinds)
 {
     int return_value = PROC_ARGLIST_STOP;
+    bool is_and_or_list = false;
+    char previous_operator = '\0';
+    int start = 0;
 
-    // first detect special operations if there are any.
-    // assumption: a command line will contain at most one type of special operation.
-    if (is_piping_command(count, arglist)) {
-        if (GENERAL_SUCCESS != run_piped_commands(count, arglist)) {
+    reaper_poll(0); // reap background processes that are already done - best effort.
+
+    if (0 == strcmp(arglist[0], "step")) {
+        // the previous parallel command lines were not declared as dependencies - let them finish first.
+        if ((GENERAL_SUCCESS != parallel_drain()) || (GENERAL_FAILURE == run_step_declaration(count, arglist, kinds))) {
             goto cleanup;
         }
-    } else if (is_background_command(count, arglist)) {
-        arglist[count - 1] = NULL; // Do not pass the & argument to execvp().
-        if (GENERAL_SUCCESS != run_command(count, arglist, false)) {
-            goto cleanup;
+        return_value = PROC_ARGLIST_CONTINUE;
+        goto cleanup;
+    }
+    if (GENERAL_SUCCESS != steps_drain()) {
+        goto cleanup;
+    }
+
+    // an and-or list has no empty command lines, and is not run in the background as a whole.
+    for (int i = 0; i < count; ++i) {
+        if (('A' == kinds[i]) || ('O' == kinds[i])) {
+            if ((i == start) || (i + 1 == count)) {
+                fprintf(stderr, "Error: syntax error.\n");
+                last_status = SYNTAX_ERROR_STATUS;
+                return_value = PROC_ARGLIST_CONTINUE;
+                goto cleanup;
+            }
+            is_and_or_list = true;
+            start = i + 1;
         }
-    } else if (is_input_redirection_command(count, arglist)) {
-        if (GENERAL_SUCCESS != run_input_redirection_command(count, arglist)) {
+    }
+    if (!is_and_or_list) {
+        if (GENERAL_SUCCESS != expand_status(count, arglist)) {
             goto cleanup;
         }
-    } else if (is_output_redirection_command(count, arglist)) {
-        if (GENERAL_SUCCESS != run_output_redirection_command(count, arglist)) {
+        return run_command_line(count, arglist, kinds, true);
+    }
+    for (int i = 0; i < count; ++i) {
+        if ('&' == kinds[i]) {
+            fprintf(stderr, "Error: an and-or list cannot run in the background.\n");
+            last_status = SYNTAX_ERROR_STATUS;
+            return_value = PROC_ARGLIST_CONTINUE;
             goto cleanup;
         }
-    } else {
-        if (GENERAL_SUCCESS != run_command(count, arglist, true)) {
-            goto cleanup;
+    }
+
+    // each command line of the list waits for the previous one, whose status decides whether it runs at all.
+    start = 0;
+    for (int i = 0; i <= count; ++i) {
+        if ((i < count) && ('A' != kinds[i]) && ('O' != kinds[i])) {
+            continue;
+        }
+        if (('\0' == previous_operator) || (('A' == previous_operator) == (0 == last_status))) {
+            arglist[i] = NULL;  // terminates this command line, in place of the operator.
+            if (GENERAL_SUCCESS != expand_status(i - start, &arglist[start])) {
+                goto cleanup;
+            }
+            if (PROC_ARGLIST_CONTINUE != run_command_line(i - start, &arglist[start], &kinds[start], false)) {
+                goto cleanup;
+            }
         }
+        previous_operator = (i < count) ? kinds[i] : '\0';
+        start = i + 1;
     }
 
     return_value = PROC_ARGLIST_CONTINUE;
@@ -401,9 +4108,51 @@ cleanup:
     return return_value;
 }
 
+/*
+ * Same as process_tokenized_arglist, for callers that did not classify the words while tokenizing.
+*/
+int process_arglist(int count, char** arglist)
+{
+    char kinds[count];
+
+    for (int i = 0; i < count; ++i) {
+        kinds[i] = word_kind(arglist[i]);
+    }
+    return process_tokenized_arglist(count, arglist, kinds);
+}
+
 int finalize(void)
 {
+    int return_code = steps_drain();
+
+    if (0 != parallel.max_jobs) {
+        struct timespec now;
+        double elapsed = 0;
+
+        if (GENERAL_SUCCESS != parallel_drain()) {
+            return_code = GENERAL_FAILURE;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = timespec_to_seconds(&now) - timespec_to_seconds(&parallel.start_time);
+        fprintf(stderr, "parallel: %zu command lines in %.3fs (%.1f lines/s) with up to %d jobs\n",
+                parallel.launched, elapsed, (elapsed > 0) ? (parallel.launched / elapsed) : 0.0, parallel.max_jobs);
+    }
+
     signal(SIGINT, SIG_DFL); // restore default behavior for SIGINT - best effort, doesn't check for errors.
-    signal(SIGCHLD, SIG_DFL); // restore default behavior for SIGCHLD - best effort, doesn't check for errors.
-    return GENERAL_SUCCESS;
+    jobs_destroy();
+    zygote_stop();
+    reaper_destroy();
+    steps_destroy();
+    free(current_command.stages);
+    free(current_command.children);
+    free(memo.commands);
+    free(cpu_policy.text);
+    if (-1 != cgroups.parent_fd) {
+        close(cgroups.parent_fd);   // after the jobs, which remove their leaves.
+    }
+    if ((NULL != cgroups.shared_spec) && (MAP_FAILED != cgroups.shared_spec)) {
+        munmap(cgroups.shared_spec, sizeof(launch_spec_t));
+    }
+    path_cache_reset();
+    return return_code;
 }
@@ -3,62 +3,379 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_BLOCK_SIZE 32
+#define SCAN_BLOCK_MASK 0xFFFFFFFFu
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_BLOCK_SIZE 16
+#define SCAN_BLOCK_MASK 0xFFFFu
+#endif
 
 // arglist - a list of char* arguments (words) provided by the user
 // it contains count+1 items, where the last item (arglist[count]) and *only* the last is NULL
 // RETURNS - 1 if should continue, 0 otherwise
 int process_arglist(int count, char** arglist);
 
+// same as process_arglist, with the operators already found by the tokenizer:
+// kinds[i] is the operator ('|', '&', '<', '>', or 'A' for "&&", 'O' for "||", 'a' for ">>", 'e' for "2>", 'd' for "2>&1"
+// and 'b' for "&>") if arglist[i] is exactly that operator, '\0' for any other word.
+int process_tokenized_arglist(int count, char** arglist, const char* kinds);
+
 // prepare and finalize calls for initialization and destruction of anything required
 int prepare(void);
 int finalize(void);
 
-int main(void)
+// runs up to max_jobs foreground command lines at once, their outputs in input order. call after prepare. returns 0 on success.
+int set_parallel_jobs(int max_jobs);
+
+// serves command lines from clients of a UNIX socket at socket_path, until killed. call after prepare. returns 0 on success.
+int serve(const char* socket_path);
+
+// waits until fd is readable, reaping the children that exit meanwhile. call after prepare. returns 0 on success.
+int wait_for_input(int fd);
+
+// bytes asked for by each read of a stream.
+#define READ_CHUNK (4096)
+
+// per-line storage - reset (not freed) between lines, so steady state parsing does not allocate at all.
+typedef struct {
+	char* line;			// read buffer of a stream, grows to the longest line seen.
+	size_t line_size;
+	size_t line_start;		// the next line begins here ...
+	size_t line_fill;		// ... and the input read so far ends here.
+	char** arglist;			// grows geometrically to the most words seen on a line (+1 for the NULL).
+	char* kinds;			// operator of each word, see process_tokenized_arglist. same capacity as arglist.
+	size_t arglist_capacity;
+} line_arena_t;
+
+// makes room for at least capacity items in arena->arglist. returns 0 on success.
+static int reserve_arglist(line_arena_t* arena, size_t capacity)
+{
+	if (capacity <= arena->arglist_capacity)
+		return 0;
+
+	size_t new_capacity = (arena->arglist_capacity == 0) ? 16 : arena->arglist_capacity;
+	while (new_capacity < capacity)
+		new_capacity *= 2;
+
+	char** arglist = (char**) realloc(arena->arglist, sizeof(char*) * new_capacity);
+	if (arglist == NULL)
+		return -1;
+	arena->arglist = arglist;
+
+	char* kinds = (char*) realloc(arena->kinds, new_capacity);
+	if (kinds == NULL)
+		return -1;
+	arena->kinds = kinds;
+
+	arena->arglist_capacity = new_capacity;
+	return 0;
+}
+
+static bool is_delimiter(char c)
+{
+	return (c == ' ') || (c == '\t') || (c == '\n');
+}
+
+#ifdef SCAN_BLOCK_SIZE
+// bit i is set if c[i] is a delimiter. reads SCAN_BLOCK_SIZE bytes.
+static inline unsigned int delimiter_mask(const char* c)
+{
+#if defined(__AVX2__)
+	__m256i block = _mm256_loadu_si256((const __m256i*) c);
+	__m256i delimiters = _mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\t'))),
+		_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')));
+	return (unsigned int) _mm256_movemask_epi8(delimiters);
+#else
+	__m128i block = _mm_loadu_si128((const __m128i*) c);
+	__m128i delimiters = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\t'))),
+		_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')));
+	return (unsigned int) _mm_movemask_epi8(delimiters);
+#endif
+}
+#endif
+
+// returns the first position in [c, end) that is a delimiter (or is not, if !want_delimiter), end if there is none.
+// whole blocks are checked with SIMD compares, the tail (and non x86 builds) byte by byte.
+static char* scan(char* c, char* end, bool want_delimiter)
+{
+#ifdef SCAN_BLOCK_SIZE
+	while (end - c >= SCAN_BLOCK_SIZE) {
+		unsigned int mask = delimiter_mask(c);
+		if (!want_delimiter)
+			mask = ~mask & SCAN_BLOCK_MASK;
+		if (mask != 0)
+			return c + __builtin_ctz(mask);
+		c += SCAN_BLOCK_SIZE;
+	}
+#endif
+	while ((c < end) && (is_delimiter(*c) != want_delimiter))
+		++c;
+	return c;
+}
+
+static char operator_kind(const char* word, size_t length)
+{
+	if ((length == 1) && ((*word == '|') || (*word == '&') || (*word == '<') || (*word == '>')))
+		return *word;
+	if ((length == 2) && (word[0] == word[1]) && ((*word == '&') || (*word == '|')))
+		return (*word == '&') ? 'A' : 'O';
+	if ((length == 2) && (memcmp(word, ">>", 2) == 0))
+		return 'a';
+	if ((length == 2) && (memcmp(word, "2>", 2) == 0))
+		return 'e';
+	if ((length == 2) && (memcmp(word, "&>", 2) == 0))
+		return 'b';
+	if ((length == 4) && (memcmp(word, "2>&1", 4) == 0))
+		return 'd';
+	return '\0';
+}
+
+// splits [line, end) into arena->arglist in place - each word is terminated by overwriting the delimiter after it.
+// the operator words are flagged in arena->kinds in the same pass.
+// *end must be writable (or already '\0'), it terminates the last word. returns the number of words, -1 on failure.
+static int tokenize_line(line_arena_t* arena, char* line, char* end)
+{
+	int count = 0;
+	char* c = line;
+
+	while (1) {
+		c = scan(c, end, false);
+
+		if (reserve_arglist(arena, count + 1) != 0)
+			return -1;
+
+		if (c == end) {
+			arena->arglist[count] = NULL;
+			return count;
+		}
+
+		char* word = c;
+		c = scan(c, end, true);
+		arena->arglist[count] = word;
+		arena->kinds[count] = operator_kind(word, c - word);
+		++count;
+
+		*c = '\0';
+		if (c < end)
+			++c;
+	}
+}
+
+// maps a script (a regular file) privately, with one writable byte past its end for the tokenizer.
+// returns NULL on failure.
+static char* map_script(int fd, size_t size)
+{
+	// an anonymous mapping one byte longer than the file, then the file over it. the byte after the file is
+	// either zero-fill of the file's last page or an anonymous page - writable in both cases.
+	char* data = mmap(NULL, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	if (mmap(data, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(data, size + 1);
+		return NULL;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+	return data;
+}
+
+// runs a script file without reading or copying it - lines are tokenized in place in a private mapping.
+// returns 0 when the script is done (or process_arglist asked to stop), -1 on failure.
+static int run_mapped_script(int fd, size_t size, line_arena_t* arena)
+{
+	char* data = NULL;
+	char* line = NULL;
+	char* data_end = NULL;
+
+	if (size == 0)
+		return 0;
+
+	data = map_script(fd, size);
+	if (data == NULL) {
+		printf("mmap failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	data_end = data + size;
+	for (line = data; line < data_end; ) {
+		char* line_end = memchr(line, '\n', data_end - line);
+		if (line_end == NULL)
+			line_end = data_end;
+
+		int count = tokenize_line(arena, line, line_end);
+		if (count == -1) {
+			printf("realloc failed: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		if ((count != 0) && !process_tokenized_arglist(count, arena->arglist, arena->kinds))
+			break;
+
+		line = line_end + 1;
+	}
+
+	munmap(data, size + 1);
+	return 0;
+}
+
+// reads more of a stream into arena->line, after its partial line (moved to the front), keeping one writable byte past
+// the input for the tokenizer. returns the number of bytes read, 0 at the end of the input, -1 on failure.
+static ssize_t read_more(int fd, line_arena_t* arena)
+{
+	size_t pending = arena->line_fill - arena->line_start;
+	ssize_t length = -1;
+
+	if (pending != 0)
+		memmove(arena->line, arena->line + arena->line_start, pending);
+	arena->line_start = 0;
+	arena->line_fill = pending;
+
+	if (arena->line_size - arena->line_fill < READ_CHUNK + 1) {
+		size_t new_size = (arena->line_size == 0) ? (2 * READ_CHUNK) : arena->line_size;
+		while (new_size - arena->line_fill < READ_CHUNK + 1)
+			new_size *= 2;
+
+		char* line = (char*) realloc(arena->line, new_size);
+		if (line == NULL)
+			return -1;
+		arena->line = line;
+		arena->line_size = new_size;
+	}
+
+	if (wait_for_input(fd) != 0)
+		return -1;
+
+	do {
+		length = read(fd, arena->line + arena->line_fill, arena->line_size - arena->line_fill - 1);
+	} while ((length == -1) && (errno == EINTR));
+
+	if (length > 0)
+		arena->line_fill += length;
+	return length;
+}
+
+// runs commands read line by line (a terminal, a pipe, ...).
+// the shell blocks in wait_for_input rather than in read, so background jobs are reaped as they exit.
+static void run_stream(int fd, line_arena_t* arena)
 {
-	if (prepare() != 0)
-		exit(1);
-	
 	while (1)
 	{
-		char** arglist = NULL;
 		char* line = NULL;
-		size_t size;
-		int count = 0;
+		char* line_end = NULL;
 
-		if (getline(&line, &size, stdin) == -1) {
-			free(line);
-			break;
+		if (arena->line_start < arena->line_fill)
+			line_end = memchr(arena->line + arena->line_start, '\n', arena->line_fill - arena->line_start);
+
+		if (line_end == NULL) {
+			ssize_t length = read_more(fd, arena);
+			if (length == -1) {
+				printf("read failed: %s\n", strerror(errno));
+				break;
+			}
+			if (length != 0)
+				continue;
+			if (arena->line_start == arena->line_fill)
+				break;
+
+			// the last line, with no '\n' after it.
+			line = arena->line + arena->line_start;
+			line_end = arena->line + arena->line_fill;
+			arena->line_start = arena->line_fill;
+		} else {
+			line = arena->line + arena->line_start;
+			arena->line_start = (line_end + 1) - arena->line;
 		}
-    
-		arglist = (char**) malloc(sizeof(char*));
-		if (arglist == NULL) {
-			printf("malloc failed: %s\n", strerror(errno));
+
+		int count = tokenize_line(arena, line, line_end);
+		if (count == -1) {
+			printf("realloc failed: %s\n", strerror(errno));
 			exit(1);
 		}
-		arglist[0] = strtok(line, " \t\n");
-    
-		while (arglist[count] != NULL) {
-			++count;
-			arglist = (char**) realloc(arglist, sizeof(char*) * (count + 1));
-			if (arglist == NULL) {
-				printf("realloc failed: %s\n", strerror(errno));
-				exit(1);
-			}
-      
-			arglist[count] = strtok(NULL, " \t\n");
-		}
     
 		if (count != 0) {
-			if (!process_arglist(count, arglist)) {
-				free(line);
-				free(arglist);
+			if (!process_tokenized_arglist(count, arena->arglist, arena->kinds))
 				break;
+		}
+	}
+}
+
+// usage: shell [-j jobs] [-f script | -s socket]
+// a script (given by -f, or a regular file redirected to stdin) is mapped instead of read line by line.
+// -j runs independent command lines in parallel, see set_parallel_jobs. -s runs a server instead, see serve.
+int main(int argc, char** argv)
+{
+	line_arena_t arena = { 0 };
+	int script_fd = STDIN_FILENO;
+	const char* script_path = NULL;
+	const char* socket_path = NULL;
+	int max_jobs = 0;
+	struct stat script_stat;
+
+	for (int i = 1; i < argc; i += 2) {
+		char* end = NULL;
+		if ((i + 1 < argc) && (strcmp(argv[i], "-f") == 0) && (script_path == NULL)) {
+			script_path = argv[i + 1];
+		} else if ((i + 1 < argc) && (strcmp(argv[i], "-s") == 0) && (socket_path == NULL)) {
+			socket_path = argv[i + 1];
+		} else if ((i + 1 < argc) && (strcmp(argv[i], "-j") == 0) && (max_jobs == 0)) {
+			max_jobs = (int) strtol(argv[i + 1], &end, 10);
+			if ((*end != '\0') || (max_jobs < 1)) {
+				fprintf(stderr, "%s: invalid number of jobs '%s'\n", argv[0], argv[i + 1]);
+				exit(1);
 			}
+		} else {
+			fprintf(stderr, "usage: %s [-j jobs] [-f script | -s socket]\n", argv[0]);
+			exit(1);
 		}
-    
-		free(line);
-		free(arglist);
 	}
+	if ((script_path != NULL) && (socket_path != NULL)) {
+		fprintf(stderr, "usage: %s [-j jobs] [-f script | -s socket]\n", argv[0]);
+		exit(1);
+	}
+
+	if (script_path != NULL) {
+		script_fd = open(script_path, O_RDONLY | O_CLOEXEC);
+		if (script_fd == -1) {
+			printf("open failed: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (prepare() != 0)
+		exit(1);
+
+	if ((max_jobs != 0) && (set_parallel_jobs(max_jobs) != 0))
+		exit(1);
+
+	if (socket_path != NULL) {
+		serve(socket_path);	// returns on failure only.
+		finalize();
+		exit(1);
+	}
+
+	if ((fstat(script_fd, &script_stat) == 0) && S_ISREG(script_stat.st_mode)) {
+		// nothing is read through the fd - move it past the script, so commands reading stdin do not get the script's lines.
+		lseek(script_fd, 0, SEEK_END);
+		if (run_mapped_script(script_fd, script_stat.st_size, &arena) != 0)
+			exit(1);
+	} else {
+		run_stream(script_fd, &arena);
+	}
+
+	free(arena.line);
+	free(arena.arglist);
+	free(arena.kinds);
 	
 	if (finalize() != 0)
 		exit(1);